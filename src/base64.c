@@ -86,6 +86,85 @@ int base64_encode(const char *input, int ilen, char *output, int olen)
   return i;
 }
 
+/*
+ * Decode tables: the value of a character shifted to its position in a
+ * group of four, or DECODE_INVALID, so that a group is decoded with four
+ * lookups ORed together, and checked for non-alphabet characters at once.
+ */
+#define DECODE_INVALID	0x01000000
+
+static uint32_t decode_table[4][256];
+static int decode_table_ready = 0;
+
+static void init_decode_table(void)
+{
+  int c, k;
+
+  for (c = 0; c < 256; c += 1) {
+    int v = decode(c);
+    for (k = 0; k < 4; k += 1) {
+      decode_table[k][c] =
+        v == INVALID_CHAR ? DECODE_INVALID : (uint32_t)v << (18 - 6 * k);
+    }
+  }
+  decode_table_ready = 1;
+}
+
+static inline uint32_t decode_group(const unsigned char *in)
+{
+  return decode_table[0][in[0]] | decode_table[1][in[1]] |
+         decode_table[2][in[2]] | decode_table[3][in[3]];
+}
+
+static inline void store_group(char *out, uint32_t v)
+{
+  out[0] = v >> 16;
+  out[1] = (v >> 8) & 0xff;
+  out[2] = v & 0xff;
+}
+
+/*
+ * Decode whole groups, four at a time while possible, stopping before a
+ * group with a non-alphabet character (padding or invalid).
+ * Returns the number of characters decoded.
+ */
+static int decode_groups(const char *input, int ilen, char *out)
+{
+  const unsigned char *in = (const unsigned char *)input;
+  int n = 0;
+
+  if (!decode_table_ready) {
+    init_decode_table();
+  }
+  while (ilen - n >= 16) {
+    uint32_t v0 = decode_group(in);
+    uint32_t v1 = decode_group(in + 4);
+    uint32_t v2 = decode_group(in + 8);
+    uint32_t v3 = decode_group(in + 12);
+    if ((v0 | v1 | v2 | v3) & DECODE_INVALID) {
+      break;
+    }
+    store_group(out, v0);
+    store_group(out + 3, v1);
+    store_group(out + 6, v2);
+    store_group(out + 9, v3);
+    in += 16;
+    out += 12;
+    n += 16;
+  }
+  while (ilen - n >= 4) {
+    uint32_t v = decode_group(in);
+    if (v & DECODE_INVALID) {
+      break;
+    }
+    store_group(out, v);
+    in += 4;
+    out += 3;
+    n += 4;
+  }
+  return n;
+}
+
 static int decode_chars(const char *input, int num)
 {
   int i;
@@ -104,23 +183,21 @@ static int decode_chars(const char *input, int num)
 
 static int do_decode(const char *input, int ilen, char *out)
 {
-  int i = 0;
+  int i;
   int dec_v;
+  int n = decode_groups(input, ilen, out);
 
-  while (ilen >= 4) {
-    dec_v = decode_chars(input, 4);
-    if (dec_v < 0) {
-      return dec_v;
-    }
-    out[i] = dec_v >> 16;
-    out[i + 1] = (dec_v >> 8) & 0xff;
-    out[i + 2] = dec_v & 0xff;
-    i += 3;
-    ilen -= 4;
-    input += 4;
+  if (ilen - n >= 4) {
+    return B64_INVALID_CHAR;
   }
+  i = n / 4 * 3;
+  input += n;
+  ilen -= n;
   if (ilen >= 2) {
     dec_v = decode_chars(input, ilen);
+    if (dec_v < 0) {
+      return dec_v;
+    }
     out[i] = dec_v >> 16;
     i += 1;
     if (ilen == 3) {
@@ -175,6 +252,92 @@ int base64_decode(const char *input, int ilen, char *out, int olen)
 }
 
 
+void base64_stream_init(base64_stream *bs)
+{
+  bs->bits = 0;
+  bs->nchars = 0;
+}
+
+static int flush_group(base64_stream *bs, char *out)
+{
+  int n = bs->nchars;
+  uint32_t bits = bs->bits;
+
+  bs->bits = 0;
+  bs->nchars = 0;
+  if (n == 2) {
+    out[0] = bits >> 4;
+    return 1;
+  }
+  if (n == 3) {
+    out[0] = bits >> 10;
+    out[1] = (bits >> 2) & 0xff;
+    return 2;
+  }
+  if (n == 1) {
+    return B64_INVALID_LEN;
+  }
+  return 0;
+}
+
+/*
+ * Decode the next chunk of a base64 stream.
+ * An incomplete group is kept in the stream state for the next chunk.
+ * Padding completes a group, so padded pieces may be concatenated.
+ * out must have room for BASE64_STREAM_OLEN(ilen) bytes.
+ */
+int base64_decode_stream(base64_stream *bs, const char *input, int ilen,
+                         char *out)
+{
+  int i = 0;
+
+  while (ilen > 0) {
+    if (bs->nchars == 0) {
+      int n = decode_groups(input, ilen, out + i);
+      input += n;
+      ilen -= n;
+      i += n / 4 * 3;
+      if (ilen == 0) {
+        break;
+      }
+    }
+    char c = *input++;
+    ilen -= 1;
+    if (c == '=') {
+      int ret = flush_group(bs, out + i);
+      if (ret < 0) {
+        return ret;
+      }
+      i += ret;
+      continue;
+    }
+    int v = decode(c);
+    if (v == INVALID_CHAR) {
+      return B64_INVALID_CHAR;
+    }
+    bs->bits = (bs->bits << 6) | v;
+    bs->nchars += 1;
+    if (bs->nchars == 4) {
+      out[i] = bs->bits >> 16;
+      out[i + 1] = (bs->bits >> 8) & 0xff;
+      out[i + 2] = bs->bits & 0xff;
+      i += 3;
+      bs->bits = 0;
+      bs->nchars = 0;
+    }
+  }
+  return i;
+}
+
+/*
+ * Complete an unpadded stream; out must have room for 2 bytes.
+ */
+int base64_stream_finish(base64_stream *bs, char *out)
+{
+  return flush_group(bs, out);
+}
+
+
 #ifdef BASE64_TEST
 #include <stdio.h>
 #include <string.h>
@@ -263,6 +426,76 @@ static void test_decode(void)
   printf("Decode PASSED\n");
 }
 
+/* Decode s through the stream decoder, split into chunks at a and b */
+static void decode_stream_split(const char *s, int a, int b, char *out)
+{
+  base64_stream bs;
+  int len = strlen(s);
+  int bounds[4] = { 0, a, b, len };
+  int out_len = 0;
+  int ret;
+  int k;
+
+  base64_stream_init(&bs);
+  for (k = 0; k < 3; k += 1) {
+    ret = base64_decode_stream(&bs, s + bounds[k], bounds[k + 1] - bounds[k],
+                               out + out_len);
+    if (ret < 0) {
+      error("Stream decode %s split at %d, %d return %d\n", s, a, b, ret);
+    }
+    out_len += ret;
+  }
+  ret = base64_stream_finish(&bs, out + out_len);
+  if (ret < 0) {
+    error("Stream finish %s split at %d, %d return %d\n", s, a, b, ret);
+  }
+  out[out_len + ret] = '\0';
+}
+
+/* Decode s split at every pair of offsets, and compare with expect */
+static void check_stream(const char *s, const char *expect)
+{
+  char buf[1024];
+  int len = strlen(s);
+  int a, b;
+
+  for (a = 0; a <= len; a += 1) {
+    for (b = a; b <= len; b += 1) {
+      decode_stream_split(s, a, b, &buf[0]);
+      if (strcmp(buf, expect) != 0) {
+        error("Stream decode %s split at %d, %d return %s, expect %s\n",
+              s, a, b, buf, expect);
+      }
+    }
+  }
+}
+
+static void test_decode_stream(void)
+{
+  char enc[1024], orig[1024], *pad;
+  unsigned int i, j;
+
+  for (i = 0; i < ARRAY_SIZE(test_sets); i += 1) {
+    /* padded */
+    check_stream(test_sets[i].encode, test_sets[i].orig);
+
+    /* unpadded, completed by base64_stream_finish */
+    strcpy(enc, test_sets[i].encode);
+    pad = strchr(enc, '=');
+    if (pad)
+      *pad = '\0';
+    check_stream(enc, test_sets[i].orig);
+
+    /* concatenated, with padding in the middle */
+    for (j = 0; j < ARRAY_SIZE(test_sets); j += 1) {
+      sprintf(enc, "%s%s", test_sets[i].encode, test_sets[j].encode);
+      sprintf(orig, "%s%s", test_sets[i].orig, test_sets[j].orig);
+      check_stream(enc, orig);
+    }
+  }
+  printf("Stream decode PASSED\n");
+}
+
 int main(int argc, char *argv[])
 {
   (void)argc;
@@ -270,6 +503,7 @@ int main(int argc, char *argv[])
 
   test_encode();
   test_decode();
+  test_decode_stream();
 
   return 0;
 }
@@ -15,4 +15,18 @@ int base64_encode(const char *input, int ilen, char *output, int olen);
 int base64_decode(const char *input, int ilen, char *out, int olen);
 int base64_decode_clip(const char *input, int ilen, char *out, int olen);
 
+/* Incremental decoding of a base64 stream that arrives in chunks */
+typedef struct {
+  unsigned int bits;	/* characters of an incomplete group */
+  int nchars;
+} base64_stream;
+
+/* Output space needed to decode a chunk of ilen characters */
+#define BASE64_STREAM_OLEN(ilen)	(((ilen) / 4 + 2) * 3)
+
+void base64_stream_init(base64_stream *bs);
+int base64_decode_stream(base64_stream *bs, const char *input, int ilen,
+                         char *out);
+int base64_stream_finish(base64_stream *bs, char *out);
+
 #endif
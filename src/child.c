@@ -8,6 +8,9 @@
 #include "charset.h"
 
 #include "winpriv.h"  /* win_prefix_title */
+#include "logfile.h"
+#include "record.h"
+#include "latency.h"
 
 #include <pwd.h>
 #include <fcntl.h>
@@ -16,6 +19,8 @@
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/cygwin.h>
 
 #if CYGWIN_VERSION_API_MINOR >= 93
@@ -42,8 +47,42 @@ static bool killed;
 static int win_fd;
 static int pty_fd = -1;
 static int log_fd = -1;
+static bool log_record;
 bool logging = false;
 
+// pty read buffer size range, and time to keep reading before returning
+// to the message loop
+#define PTY_READ_MIN (64 * 1024)
+#define PTY_READ_MAX (1024 * 1024)
+#define PTY_DRAIN_TICKS 20
+
+// Pty output is read by a separate thread into a single-producer,
+// single-consumer ring, so that the child process is not held up by
+// terminal processing or window message handling, and vice versa.
+// Head and tail are free-running counters, each written by one side.
+// The reader wakes the terminal through a pipe watched by child_proc,
+// writing to it only when no wakeup is pending; when the ring is full,
+// it waits for the terminal to consume output, holding back the child.
+#define PTY_RING_SIZE (1024 * 1024)
+#define PTY_WRITE_MAX (64 * 1024)   // output passed to term_write at once
+
+static bool reader_running = false;
+static int wake_pipe[2] = {-1, -1};
+// Output not read while the terminal cannot take it (see term_input_room)
+static bool input_held = false;
+// SIGCHLD is passed on to child_proc through this pipe
+static int sigchld_pipe[2] = {-1, -1};
+#if CYGWIN_VERSION_DLL_MAJOR >= 1005
+static char *ring;
+static uint ring_head;  // written by the reader
+static uint ring_tail;  // written by the terminal
+static int wake_pending;
+static int reader_waiting;
+static bool reader_done;
+static pthread_mutex_t reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
 #if CYGWIN_VERSION_API_MINOR >= 66
 #include <langinfo.h>
 #endif
@@ -90,15 +129,42 @@ childerror(char * action, bool from_fork, int errno_code, int code)
 }
 
 static void
-sigexit(int sig)
+sigchld(int sig)
+{
+  (void)sig;
+  int err = errno;
+  write(sigchld_pipe[1], "", 1);
+  errno = err;
+}
+
+// Termination signal, to be handled by child_proc.
+static volatile sig_atomic_t exit_signal = 0;
+
+static void
+die(int sig)
 {
-  if (pid)
-    kill(-pid, SIGHUP);
   signal(sig, SIG_DFL);
   report_pos();
   kill(getpid(), sig);
 }
 
+static void
+sigexit(int sig)
+{
+  if (pid)
+    kill(-pid, SIGHUP);
+  // Leave it to child_proc to die, after the log file has been completed;
+  // die right away if it can't be woken up, or on a repeated signal.
+  if (sigchld_pipe[1] >= 0 && !exit_signal) {
+    exit_signal = sig;
+    int err = errno;
+    write(sigchld_pipe[1], "", 1);
+    errno = err;
+  }
+  else
+    die(sig);
+}
+
 static void
 open_logfile(bool toggling)
 {
@@ -160,6 +226,14 @@ open_logfile(bool toggling)
 
       free(log);
     }
+
+    if (log_fd >= 0) {
+      // recordings are left uncompressed for seeking
+      log_record = cfg.log_record;
+      logfile_start(log_fd, cfg.log_compress && !log_record, cfg.log_sync);
+      if (log_record)
+        record_start();
+    }
   }
 }
 
@@ -168,12 +242,38 @@ toggle_logging()
 {
   if (logging)
     logging = false;
-  else if (log_fd >= 0)
+  else if (log_fd >= 0) {
     logging = true;
+    if (log_record)
+      record_start();
+  }
   else
     open_logfile(true);
 }
 
+static void
+log_output(const char *buf, uint len)
+{
+  if (log_fd >= 0 && logging) {
+    if (log_record)
+      record_output(buf, len);
+    else
+      logfile_write(buf, len);
+  }
+}
+
+/*
+ * Pass output read from the pty to the terminal and the log.
+ */
+static void
+show_output(const char *buf, uint len)
+{
+  latency_mark(LAT_READ);
+  term_write(buf, len);
+  latency_mark(LAT_WRITE);
+  log_output(buf, len);
+}
+
 void
 child_update_charset(void)
 {
@@ -192,6 +292,142 @@ child_update_charset(void)
 #endif
 }
 
+#if CYGWIN_VERSION_DLL_MAJOR >= 1005
+
+static void
+wake_terminal(void)
+{
+  if (!__atomic_exchange_n(&wake_pending, 1, __ATOMIC_SEQ_CST))
+    write(wake_pipe[1], "", 1);
+}
+
+static void *
+pty_reader(void *arg)
+{
+  int fd = (intptr_t)arg;
+
+  for (;;) {
+    uint head = ring_head;
+    uint tail = __atomic_load_n(&ring_tail, __ATOMIC_SEQ_CST);
+    uint space = PTY_RING_SIZE - (head - tail);
+    if (!space) {
+      // Wait for the terminal to catch up, holding back the child.
+      pthread_mutex_lock(&reader_mutex);
+      __atomic_store_n(&reader_waiting, 1, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&ring_tail, __ATOMIC_SEQ_CST) == tail)
+        pthread_cond_wait(&reader_cond, &reader_mutex);
+      __atomic_store_n(&reader_waiting, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&reader_mutex);
+      continue;
+    }
+
+    uint pos = head & (PTY_RING_SIZE - 1);
+    int len = read(fd, ring + pos, min(space, PTY_RING_SIZE - pos));
+    if (len > 0) {
+      __atomic_store_n(&ring_head, head + len, __ATOMIC_SEQ_CST);
+      wake_terminal();
+    }
+    else if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(fd, &fds);
+      select(fd + 1, &fds, 0, 0, 0);
+    }
+    else {
+      __atomic_store_n(&reader_done, true, __ATOMIC_SEQ_CST);
+      wake_terminal();
+      return 0;
+    }
+  }
+}
+
+static void
+start_reader(void)
+{
+  pthread_t thread;
+
+  ring = malloc(PTY_RING_SIZE);
+  if (!ring)
+    return;
+  if (pipe(wake_pipe) < 0) {
+    free(ring);
+    return;
+  }
+  // keep the pipe from leaking into the child process or user commands
+  fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC);
+  if (pthread_create(&thread, 0, pty_reader, (void *)(intptr_t)pty_fd)) {
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    free(ring);
+    return;
+  }
+  pthread_detach(thread);
+  reader_running = true;
+}
+
+// Process output collected by the reader thread, until the ring is
+// drained or the time budget is spent.
+static void
+read_ring(void)
+{
+  char c[16];
+  read(wake_pipe[0], c, sizeof c);
+  __atomic_store_n(&wake_pending, 0, __ATOMIC_SEQ_CST);
+
+  int start = get_tick_count();
+  for (;;) {
+    uint tail = ring_tail;
+    uint head = __atomic_load_n(&ring_head, __ATOMIC_SEQ_CST);
+    if (head == tail) {
+      if (__atomic_load_n(&reader_done, __ATOMIC_SEQ_CST) &&
+          __atomic_load_n(&ring_head, __ATOMIC_SEQ_CST) == tail) {
+        pty_fd = -1;
+        term_hide_cursor();
+      }
+      return;
+    }
+
+    uint room = term_input_room();
+    if (!room) {
+      input_held = true;
+      return;
+    }
+
+    uint pos = tail & (PTY_RING_SIZE - 1);
+    uint len = min(head - tail, min(PTY_RING_SIZE - pos, PTY_WRITE_MAX));
+    len = min(len, room);
+    show_output(ring + pos, len);
+
+    __atomic_store_n(&ring_tail, tail + len, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&reader_waiting, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&reader_mutex);
+      pthread_cond_signal(&reader_cond);
+      pthread_mutex_unlock(&reader_mutex);
+    }
+
+    if (get_tick_count() - start >= PTY_DRAIN_TICKS) {
+      // come back for the rest after handling window messages
+      wake_terminal();
+      return;
+    }
+  }
+}
+
+#endif
+
+/*
+ * Wakeups of the event loop, and those only for timers (poll timeouts);
+ * reported on exit with MINTTY_DEBUG=w.
+ */
+static uint wakeups, timer_wakeups;
+
+static void
+report_wakeups(void)
+{
+  printf("wakeups: %u, for timers only: %u\n", wakeups, timer_wakeups);
+}
+
 void
 child_create(char *argv[], struct winsize *winp)
 {
@@ -204,6 +440,24 @@ child_create(char *argv[], struct winsize *winp)
   signal(SIGTERM, sigexit);
   signal(SIGQUIT, sigexit);
 
+  char * debugopt = getenv("MINTTY_DEBUG");
+  if (debugopt && strchr(debugopt, 'w'))
+    atexit(report_wakeups);
+
+  // Wake up child_proc when the child process exits.
+  if (pipe(sigchld_pipe) == 0) {
+    fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sigchld_pipe[1], F_SETFD, FD_CLOEXEC);
+    struct sigaction sa = {
+      .sa_handler = sigchld,
+      .sa_flags = SA_RESTART | SA_NOCLDSTOP
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, 0);
+  }
+
   // Create the child process and pseudo terminal.
   pid = forkpty(&pty_fd, 0, 0, winp);
   if (pid < 0) {
@@ -251,6 +505,10 @@ child_create(char *argv[], struct winsize *winp)
     signal(SIGQUIT, SIG_DFL);
     signal(SIGTERM, SIG_DFL);
     signal(SIGCHLD, SIG_DFL);
+    if (sigchld_pipe[0] >= 0) {
+      close(sigchld_pipe[0]);
+      close(sigchld_pipe[1]);
+    }
 
     // Mimick login's behavior by disabling the job control signals
     signal(SIGTSTP, SIG_IGN);
@@ -306,6 +564,9 @@ child_create(char *argv[], struct winsize *winp)
   }
   else { // Parent process.
     fcntl(pty_fd, F_SETFL, O_NONBLOCK);
+#if CYGWIN_VERSION_DLL_MAJOR >= 1005
+    start_reader();
+#endif
 
     //child_update_charset();  // could do it here or as above
 
@@ -349,6 +610,143 @@ child_tty(void)
   return ptsname(pty_fd);
 }
 
+// Read pty output directly, when there is no reader thread.
+static void
+read_pty(void)
+{
+#if CYGWIN_VERSION_DLL_MAJOR >= 1005
+  // Keep reading until the pty is drained or the time budget is spent.
+  // The buffer grows while reads fill it, and shrinks again when
+  // output slows down.
+  static char *buf = 0;
+  static uint bufsize = 0;
+  int start = get_tick_count();
+  uint total = 0;
+  if (!buf) {
+    bufsize = PTY_READ_MIN;
+    buf = newn(char, bufsize);
+  }
+  for (;;) {
+    uint room = term_input_room();
+    if (!room) {
+      input_held = true;
+      break;
+    }
+    int len = read(pty_fd, buf, min(bufsize, room));
+    if (len > 0) {
+      show_output(buf, len);
+      total += len;
+      if ((uint)len == bufsize && bufsize < PTY_READ_MAX) {
+        bufsize *= 2;
+        buf = renewn(buf, bufsize);
+      }
+      if (get_tick_count() - start >= PTY_DRAIN_TICKS)
+        break;
+    }
+    else if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (total < bufsize / 4 && bufsize > PTY_READ_MIN) {
+        bufsize /= 2;
+        buf = renewn(buf, bufsize);
+      }
+      break;
+    }
+    else {
+      pty_fd = -1;
+      term_hide_cursor();
+      break;
+    }
+  }
+#else
+  // Pty devices on old Cygwin version deliver only 4 bytes at a time,
+  // so call read() repeatedly until we have a worthwhile haul.
+  static char buf[512];
+  uint size = min(sizeof buf, term_input_room());
+  if (!size) {
+    input_held = true;
+    return;
+  }
+  uint len = 0;
+  do {
+    int ret = read(pty_fd, buf + len, size - len);
+    if (ret > 0)
+      len += ret;
+    else
+      break;
+  } while (len < size);
+  if (len > 0)
+    show_output(buf, len);
+  else {
+    pty_fd = -1;
+    term_hide_cursor();
+  }
+#endif
+}
+
+/*
+ * Input for the child is written without blocking; what the pty does not
+ * take at once is queued, and written by child_proc when the pty becomes
+ * writable again.
+ */
+static char *input_buf;
+static uint input_size, input_pos, input_len;
+
+static void
+write_input(void)
+{
+  while (input_pos < input_len) {
+    int n = write(pty_fd, input_buf + input_pos, input_len - input_pos);
+    if (n > 0)
+      input_pos += n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else {
+      if (n < 0 && errno != EAGAIN)
+        input_pos = input_len;  // pty gone, drop the input
+      break;
+    }
+  }
+  if (input_pos == input_len) {
+    input_pos = input_len = 0;
+    // don't keep a large buffer from a big paste around
+    if (input_size > 64 * 1024) {
+      free(input_buf);
+      input_buf = 0;
+      input_size = 0;
+    }
+  }
+}
+
+void
+child_write(const char *buf, uint len)
+{
+  if (pty_fd < 0 || !len)
+    return;
+  if (input_len + len > input_size) {
+    // make room, moving the pending input to the start
+    if (input_pos) {
+      memmove(input_buf, input_buf + input_pos, input_len - input_pos);
+      input_len -= input_pos;
+      input_pos = 0;
+    }
+    if (input_len + len > input_size) {
+      input_size = max(input_len + len, input_size * 2);
+      input_buf = renewn(input_buf, input_size);
+    }
+  }
+  memcpy(input_buf + input_len, buf, len);
+  input_len += len;
+  write_input();
+}
+
+/*
+ * Input queued for the child, for pacing pastes.
+ */
+uint
+child_write_pending(void)
+{
+  return input_len - input_pos;
+}
+
 #define patch_319
 
 void
@@ -358,12 +756,45 @@ child_proc(void)
     if (term.paste_buffer)
       term_send_paste();
 
-    struct timeval timeout = {0, 100000}, *timeout_p = 0;
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(win_fd, &fds);
-    if (pty_fd >= 0)
-      FD_SET(pty_fd, &fds);
+    // Run timers that are due, and wait no longer than for the next one.
+    win_run_timers();
+    int timeout = win_timer_wait();
+
+    struct pollfd fds[4];
+    int nfds = 0;
+    int add_fd(int fd, short events) {
+      for (int i = 0; i < nfds; i++)
+        if (fds[i].fd == fd) {
+          fds[i].events |= events;
+          return i;
+        }
+      fds[nfds] = (struct pollfd){.fd = fd, .events = events};
+      return nfds++;
+    }
+    int win_i = add_fd(win_fd, POLLIN);
+    int sig_i = sigchld_pipe[0] >= 0 ? add_fd(sigchld_pipe[0], POLLIN) : -1;
+    int in_i = -1, out_i = -1;
+
+    int in_fd = reader_running ? wake_pipe[0] : pty_fd;
+    if (pty_fd >= 0) {
+      // Resume reading when the terminal can take output again.
+      if (input_held && term_input_room()) {
+        input_held = false;
+#if CYGWIN_VERSION_DLL_MAJOR >= 1005
+        if (reader_running)
+          wake_terminal();
+#endif
+      }
+      if (!input_held)
+        in_i = add_fd(in_fd, POLLIN);
+
+      // Wait for the pty to take queued input; while there is none,
+      // but a paste is still being sent, don't wait.
+      if (child_write_pending())
+        out_i = add_fd(pty_fd, POLLOUT);
+      else if (term.paste_buffer)
+        timeout = 0;
+    }
 #ifndef patch_319
     else
 #endif
@@ -424,42 +855,42 @@ child_proc(void)
           win_prefix_title(cfg.exit_title);
       }
 #ifdef patch_319
-      if (pid != 0 && pty_fd < 0) // Pty gone, but process still there: keep checking
+      if (pid != 0 && pty_fd < 0 && sig_i < 0)
 #else
-      else // Pty gone, but process still there: keep checking
+      else
 #endif
-        timeout_p = &timeout;
+        // Pty gone, but process still there, and its exit is not signalled:
+        // keep checking
+        timeout = timeout < 0 ? 100 : min(timeout, 100);
     }
 
-    if (select(win_fd + 1, &fds, 0, 0, timeout_p) > 0) {
-      if (pty_fd >= 0 && FD_ISSET(pty_fd, &fds)) {
+    int ready = poll(fds, nfds, timeout);
+    wakeups++;
+    if (ready == 0)
+      timer_wakeups++;
+    if (ready > 0) {
+      if (sig_i >= 0 && fds[sig_i].revents) {
+        // the child is checked for again above
+        char c[16];
+        while (read(sigchld_pipe[0], c, sizeof c) > 0);
+        if (exit_signal) {
+          logfile_stop();
+          die(exit_signal);
+        }
+      }
+      if (out_i >= 0 && pty_fd >= 0 &&
+          (fds[out_i].revents & (POLLOUT | POLLERR | POLLHUP)))
+        write_input();
+      if (in_i >= 0 && pty_fd >= 0 &&
+          (fds[in_i].revents & (POLLIN | POLLERR | POLLHUP))) {
 #if CYGWIN_VERSION_DLL_MAJOR >= 1005
-        static char buf[4096];
-        int len = read(pty_fd, buf, sizeof buf);
-#else
-        // Pty devices on old Cygwin version deliver only 4 bytes at a time,
-        // so call read() repeatedly until we have a worthwhile haul.
-        static char buf[512];
-        uint len = 0;
-        do {
-          int ret = read(pty_fd, buf + len, sizeof buf - len);
-          if (ret > 0)
-            len += ret;
-          else
-            break;
-        } while (len < sizeof buf);
+        if (reader_running)
+          read_ring();
+        else
 #endif
-        if (len > 0) {
-          term_write(buf, len);
-          if (log_fd >= 0 && logging)
-            write(log_fd, buf, len);
-        }
-        else {
-          pty_fd = -1;
-          term_hide_cursor();
-        }
+          read_pty();
       }
-      if (FD_ISSET(win_fd, &fds))
+      if (fds[win_i].revents)
         return;
     }
   }
@@ -512,13 +943,6 @@ child_is_parent(void)
   return res;
 }
 
-void
-child_write(const char *buf, uint len)
-{
-  if (pty_fd >= 0)
-    write(pty_fd, buf, len);
-}
-
 void
 child_printf(const char *fmt, ...)
 {
@@ -529,7 +953,7 @@ child_printf(const char *fmt, ...)
     int len = vasprintf(&s, fmt, va);
     va_end(va);
     if (len >= 0)
-      write(pty_fd, s, len);
+      child_write(s, len);
     free(s);
   }
 }
@@ -541,6 +965,7 @@ child_send(const char *buf, uint len)
   if (term.echoing)
     term_write(buf, len);
   child_write(buf, len);
+  latency_mark(LAT_SEND);
 }
 
 void
@@ -557,6 +982,8 @@ child_resize(struct winsize *winp)
 {
   if (pty_fd >= 0)
     ioctl(pty_fd, TIOCSWINSZ, winp);
+  if (log_fd >= 0 && logging && log_record)
+    record_resize(winp->ws_row, winp->ws_col);
 }
 
 static int
@@ -765,6 +1192,14 @@ child_fork(int argc, char *argv[], int moni)
   if (clone == 0) {  // prepare child process to spawn new terminal
     if (pty_fd >= 0)
       close(pty_fd);
+    if (reader_running) {
+      close(wake_pipe[0]);
+      close(wake_pipe[1]);
+    }
+    if (sigchld_pipe[0] >= 0) {
+      close(sigchld_pipe[0]);
+      close(sigchld_pipe[1]);
+    }
     if (log_fd >= 0)
       close(log_fd);
     close(win_fd);
@@ -170,7 +170,15 @@ const config default_cfg = {
     [BOLD_CYAN_I]    = 0xFFFF40,
     [BOLD_WHITE_I]   = 0xFFFFFF,
   },
-  .sixel_clip_char = W(" ")
+  .sixel_clip_char = W(" "),
+  .session_file = W(""),
+  .image_memory = 64,
+  .log_compress = false,
+  .log_sync = 0,
+  .log_record = false,
+  .input_buffer = 1024,
+  .frame_rate = 60,
+  .latency_stats = W("")
 };
 
 config cfg, new_cfg, file_cfg;
@@ -347,6 +355,14 @@ options[] = {
   {"WordCharsExcl", OPT_STRING, offcfg(word_chars_excl)},
   {"IMECursorColour", OPT_COLOUR, offcfg(ime_cursor_colour)},
   {"SixelClipChars", OPT_WSTRING, offcfg(sixel_clip_char)},
+  {"SessionFile", OPT_WSTRING, offcfg(session_file)},
+  {"ImageMemory", OPT_INT, offcfg(image_memory)},
+  {"LogCompress", OPT_BOOL, offcfg(log_compress)},
+  {"LogSync", OPT_INT, offcfg(log_sync)},
+  {"LogRecording", OPT_BOOL, offcfg(log_record)},
+  {"InputBuffer", OPT_INT, offcfg(input_buffer)},
+  {"FrameRate", OPT_INT, offcfg(frame_rate)},
+  {"LatencyStats", OPT_WSTRING, offcfg(latency_stats)},
 
   // ANSI colours
   {"Black", OPT_COLOUR, offcfg(ansi_colours[BLACK_I])},
@@ -1249,6 +1265,9 @@ finish_config(void)
   cfg.cols = max(1, cfg.cols);
   cfg.scrollback_lines = max(0, cfg.scrollback_lines);
 
+  // Hold at least one pty read chunk (64KB) while selecting, at most 1GB.
+  cfg.input_buffer = max(64, min(cfg.input_buffer, 1024 * 1024));
+
   // Ignore charset setting if we haven't got a locale.
   if (!*cfg.locale)
     strset(&cfg.charset, "");
@@ -151,6 +151,14 @@ typedef struct {
   colour ime_cursor_colour;
   colour ansi_colours[16];
   wstring sixel_clip_char;
+  wstring session_file;
+  int image_memory;
+  bool log_compress;
+  int log_sync;
+  bool log_record;
+  int input_buffer;
+  int frame_rate;
+  wstring latency_stats;
   // Legacy
   bool use_system_colours;
 } config;
@@ -0,0 +1,1011 @@
+// imgfile.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// Inline image files (iTerm2 OSC 1337 File=): the file is decoded from
+// base64 as the sequence arrives, then decoded as PNG or BMP into BGRA
+// pixels, which are delivered to the image store row by row.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "imgfile.h"
+#include "winpriv.h"
+
+static inline uint
+be32(const uchar *p)
+{
+  return (uint)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline uint
+le16(const uchar *p)
+{
+  return p[0] | p[1] << 8;
+}
+
+static inline uint
+le32(const uchar *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+}
+
+static inline uint
+colour_bgra(colour c)
+{
+  return (c >> 16 & 0xff) | (c & 0xff00) | (c & 0xff) << 16;
+}
+
+// compose a pixel over the background
+static inline uint
+blend(uint r, uint g, uint b, uint a, uint bg)
+{
+  if (a != 255) {
+    r = (r * a + (bg >> 16 & 0xff) * (255 - a) + 127) / 255;
+    g = (g * a + (bg >> 8 & 0xff) * (255 - a) + 127) / 255;
+    b = (b * a + (bg & 0xff) * (255 - a) + 127) / 255;
+  }
+  return b | g << 8 | r << 16;
+}
+
+static bool
+image_size_ok(int w, int h)
+{
+  return w > 0 && h > 0 && w <= IMGFILE_WIDTH_MAX && h <= IMGFILE_HEIGHT_MAX
+      && (size_t)w * h <= IMGFILE_PIXELS_MAX;
+}
+
+
+// Inflate (RFC 1951), into an output buffer of known size.
+// Huffman codes are decoded through a table indexed by the next
+// ZFAST_BITS input bits, falling back to a canonical code search.
+
+#define ZFAST_BITS 9
+#define ZFAST_MASK ((1 << ZFAST_BITS) - 1)
+
+typedef struct {
+  ushort fast[1 << ZFAST_BITS];  // length << 9 | symbol, or 0
+  ushort firstcode[16];
+  int maxcode[17];
+  ushort firstsymbol[16];
+  uchar size[288];
+  ushort value[288];
+} zhuffman;
+
+typedef struct {
+  const uchar *in;
+  size_t inlen;
+  size_t inpos;   // may run past inlen, reading zeros
+  uint bitbuf;
+  int bitcnt;
+  uchar *out;
+  size_t outlen;
+  size_t outpos;
+  zhuffman lit, dist;
+} zstream;
+
+static const ushort zlength_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uchar zlength_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const ushort zdist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577
+};
+static const uchar zdist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static inline int
+bitrev(int v, int bits)
+{
+  int r = 0;
+  while (bits--) {
+    r = r << 1 | (v & 1);
+    v >>= 1;
+  }
+  return r;
+}
+
+static bool
+zbuild(zhuffman *z, const uchar *sizes, int num)
+{
+  int count[17] = {0};
+  int next_code[16];
+  int code = 0, k = 0;
+
+  memset(z->fast, 0, sizeof z->fast);
+  for (int i = 0; i < num; i++)
+    count[sizes[i]]++;
+  count[0] = 0;
+  for (int i = 1; i < 16; i++) {
+    next_code[i] = code;
+    z->firstcode[i] = code;
+    z->firstsymbol[i] = k;
+    code += count[i];
+    if (count[i] && code > (1 << i))
+      return false;  // over-subscribed
+    z->maxcode[i] = code << (16 - i);
+    code <<= 1;
+    k += count[i];
+  }
+  z->maxcode[16] = 0x10000;
+  for (int i = 0; i < num; i++) {
+    int s = sizes[i];
+    if (s) {
+      int c = next_code[s] - z->firstcode[s] + z->firstsymbol[s];
+      z->size[c] = s;
+      z->value[c] = i;
+      if (s <= ZFAST_BITS) {
+        for (int j = bitrev(next_code[s], s); j < (1 << ZFAST_BITS); j += 1 << s)
+          z->fast[j] = s << 9 | i;
+      }
+      next_code[s]++;
+    }
+  }
+  return true;
+}
+
+static inline void
+zfill(zstream *zs)
+{
+  while (zs->bitcnt <= 24) {
+    uint b = zs->inpos < zs->inlen ? zs->in[zs->inpos] : 0;
+    zs->inpos++;
+    zs->bitbuf |= b << zs->bitcnt;
+    zs->bitcnt += 8;
+  }
+}
+
+static inline uint
+zbits(zstream *zs, int n)
+{
+  if (zs->bitcnt < n)
+    zfill(zs);
+  uint v = zs->bitbuf & ((1u << n) - 1);
+  zs->bitbuf >>= n;
+  zs->bitcnt -= n;
+  return v;
+}
+
+// whether more input was consumed than there is
+static inline bool
+zoverrun(zstream *zs)
+{
+  return zs->inpos - zs->bitcnt / 8 > zs->inlen;
+}
+
+static int
+zdecode(zstream *zs, zhuffman *z)
+{
+  if (zs->bitcnt < 16)
+    zfill(zs);
+  int b = z->fast[zs->bitbuf & ZFAST_MASK];
+  if (b) {
+    int n = b >> 9;
+    zs->bitbuf >>= n;
+    zs->bitcnt -= n;
+    return b & 511;
+  }
+
+  int k = bitrev(zs->bitbuf & 0xffff, 16);
+  int n;
+  for (n = ZFAST_BITS + 1; k >= z->maxcode[n]; n++)
+    ;
+  if (n >= 16)
+    return -1;
+  b = (k >> (16 - n)) - z->firstcode[n] + z->firstsymbol[n];
+  if (b >= 288 || z->size[b] != n)
+    return -1;
+  zs->bitbuf >>= n;
+  zs->bitcnt -= n;
+  return z->value[b];
+}
+
+static bool
+zcodes(zstream *zs)
+{
+  for (;;) {
+    int sym = zdecode(zs, &zs->lit);
+    if (sym < 256) {
+      if (sym < 0 || zs->outpos >= zs->outlen)
+        return false;
+      zs->out[zs->outpos++] = sym;
+    }
+    else if (sym == 256)
+      return !zoverrun(zs);
+    else {
+      sym -= 257;
+      if (sym >= 29)
+        return false;
+      uint len = zlength_base[sym] + zbits(zs, zlength_extra[sym]);
+      int d = zdecode(zs, &zs->dist);
+      if (d < 0 || d >= 30)
+        return false;
+      size_t dist = zdist_base[d] + zbits(zs, zdist_extra[d]);
+      if (dist > zs->outpos || len > zs->outlen - zs->outpos || zoverrun(zs))
+        return false;
+      uchar *p = zs->out + zs->outpos;
+      const uchar *q = p - dist;
+      zs->outpos += len;
+      while (len--)
+        *p++ = *q++;
+    }
+  }
+}
+
+static bool
+zstored(zstream *zs)
+{
+  // drop the rest of the byte, and give back whole buffered bytes
+  zbits(zs, zs->bitcnt & 7);
+  zs->inpos -= zs->bitcnt / 8;
+  zs->bitbuf = 0;
+  zs->bitcnt = 0;
+  if (zs->inpos + 4 > zs->inlen)
+    return false;
+  uint len = le16(zs->in + zs->inpos);
+  uint nlen = le16(zs->in + zs->inpos + 2);
+  zs->inpos += 4;
+  if ((len ^ 0xffff) != nlen || len > zs->inlen - zs->inpos ||
+      len > zs->outlen - zs->outpos)
+    return false;
+  memcpy(zs->out + zs->outpos, zs->in + zs->inpos, len);
+  zs->inpos += len;
+  zs->outpos += len;
+  return true;
+}
+
+static bool
+zfixed(zstream *zs)
+{
+  uchar sizes[288 + 30];
+  memset(sizes, 8, 144);
+  memset(sizes + 144, 9, 112);
+  memset(sizes + 256, 7, 24);
+  memset(sizes + 280, 8, 8);
+  memset(sizes + 288, 5, 30);
+  return zbuild(&zs->lit, sizes, 288) && zbuild(&zs->dist, sizes + 288, 30);
+}
+
+static bool
+zdynamic(zstream *zs)
+{
+  static const uchar order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+  uchar sizes[286 + 30];
+  uchar clsizes[19] = {0};
+  int hlit = zbits(zs, 5) + 257;
+  int hdist = zbits(zs, 5) + 1;
+  int hclen = zbits(zs, 4) + 4;
+
+  if (hlit > 286 || hdist > 30)
+    return false;
+  for (int i = 0; i < hclen; i++)
+    clsizes[order[i]] = zbits(zs, 3);
+  if (!zbuild(&zs->lit, clsizes, 19))
+    return false;
+
+  int n = 0;
+  while (n < hlit + hdist) {
+    int sym = zdecode(zs, &zs->lit);
+    int fill, rep;
+    if (sym < 0 || sym > 18 || zoverrun(zs))
+      return false;
+    if (sym < 16) {
+      sizes[n++] = sym;
+      continue;
+    }
+    if (sym == 16) {
+      if (!n)
+        return false;
+      fill = sizes[n - 1];
+      rep = 3 + zbits(zs, 2);
+    }
+    else if (sym == 17) {
+      fill = 0;
+      rep = 3 + zbits(zs, 3);
+    }
+    else {
+      fill = 0;
+      rep = 11 + zbits(zs, 7);
+    }
+    if (rep > hlit + hdist - n)
+      return false;
+    memset(sizes + n, fill, rep);
+    n += rep;
+  }
+  return zbuild(&zs->lit, sizes, hlit) &&
+         zbuild(&zs->dist, sizes + hlit, hdist);
+}
+
+static bool
+zinflate(zstream *zs)
+{
+  bool last;
+  do {
+    last = zbits(zs, 1);
+    switch (zbits(zs, 2)) {
+      when 0:
+        if (!zstored(zs))
+          return false;
+      when 1:
+        if (!zfixed(zs) || !zcodes(zs))
+          return false;
+      when 2:
+        if (!zdynamic(zs) || !zcodes(zs))
+          return false;
+      otherwise:
+        return false;
+    }
+  } while (!last);
+  return zs->outpos == zs->outlen;
+}
+
+
+// PNG
+
+typedef struct {
+  int width, height;
+  int depth, ctype, channels;
+  bool interlaced;
+  uchar palette[256][4];  // RGBA
+  int npalette;
+  bool has_key;
+  uint key[3];            // transparent colour
+} png_info;
+
+static inline uchar
+paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+// undo the filter of a row; prev is NULL for the first row of a pass
+static bool
+png_unfilter(uchar *row, const uchar *prev, uint rowbytes, uint bpp)
+{
+  uint i;
+
+  switch (row[-1]) {
+    when 0:
+      ;
+    when 1:
+      for (i = bpp; i < rowbytes; i++)
+        row[i] += row[i - bpp];
+    when 2:
+      if (prev)
+        for (i = 0; i < rowbytes; i++)
+          row[i] += prev[i];
+    when 3:
+      for (i = 0; i < rowbytes; i++) {
+        uint a = i >= bpp ? row[i - bpp] : 0;
+        uint b = prev ? prev[i] : 0;
+        row[i] += (a + b) >> 1;
+      }
+    when 4:
+      for (i = 0; i < rowbytes; i++) {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = prev ? prev[i] : 0;
+        int c = prev && i >= bpp ? prev[i - bpp] : 0;
+        row[i] += paeth(a, b, c);
+      }
+    otherwise:
+      return false;
+  }
+  return true;
+}
+
+static inline uint
+png_scale(uint v, int depth)
+{
+  if (depth == 8)
+    return v;
+  if (depth == 16)
+    return v >> 8;
+  return v * 255 / ((1 << depth) - 1);
+}
+
+// convert a row of n pixels, storing every step'th output pixel
+static void
+png_convert(png_info *pi, const uchar *row, int n, uint *out, int step,
+            uint bg)
+{
+  int depth = pi->depth;
+
+  for (int x = 0; x < n; x++, out += step) {
+    uint v[4];
+    uint r, g, b, a = 255;
+
+    if (depth < 8) {
+      uint bit = x * depth;
+      v[0] = row[bit >> 3] >> (8 - depth - (bit & 7)) & ((1 << depth) - 1);
+    }
+    else {
+      int bytes = depth / 8;
+      const uchar *s = row + x * pi->channels * bytes;
+      for (int i = 0; i < pi->channels; i++, s += bytes)
+        v[i] = bytes == 2 ? (uint)s[0] << 8 | s[1] : s[0];
+    }
+
+    switch (pi->ctype) {
+      when 0:
+        r = g = b = png_scale(v[0], depth);
+        if (pi->has_key && v[0] == pi->key[0])
+          a = 0;
+      when 2:
+        r = png_scale(v[0], depth);
+        g = png_scale(v[1], depth);
+        b = png_scale(v[2], depth);
+        if (pi->has_key && v[0] == pi->key[0] && v[1] == pi->key[1] &&
+            v[2] == pi->key[2])
+          a = 0;
+      when 3: {
+        const uchar *c = pi->palette[v[0] < (uint)pi->npalette ? v[0] : 0];
+        r = c[0];
+        g = c[1];
+        b = c[2];
+        a = c[3];
+      }
+      when 4:
+        r = g = b = png_scale(v[0], depth);
+        a = png_scale(v[1], depth);
+      otherwise:
+        r = png_scale(v[0], depth);
+        g = png_scale(v[1], depth);
+        b = png_scale(v[2], depth);
+        a = png_scale(v[3], depth);
+    }
+    *out = blend(r, g, b, a, bg);
+  }
+}
+
+static bool
+png_header(png_info *pi, const uchar *p, uint len)
+{
+  if (len != 13)
+    return false;
+  pi->width = be32(p);
+  pi->height = be32(p + 4);
+  pi->depth = p[8];
+  pi->ctype = p[9];
+  pi->interlaced = p[12];
+  if (p[10] || p[11] || p[12] > 1 || !image_size_ok(pi->width, pi->height))
+    return false;
+
+  int depth = pi->depth;
+  switch (pi->ctype) {
+    when 0:
+      pi->channels = 1;
+      return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+    when 3:
+      pi->channels = 1;
+      return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+    when 2:
+      pi->channels = 3;
+    when 4:
+      pi->channels = 2;
+    when 6:
+      pi->channels = 4;
+    otherwise:
+      return false;
+  }
+  return depth == 8 || depth == 16;
+}
+
+static bool
+png_decode(imgfile_state *st)
+{
+  static const uchar adam7[7][4] = {  // x start, y start, x step, y step
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+    {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+  };
+  static const uchar single[1][4] = {{0, 0, 1, 1}};
+
+  const uchar *p = st->data + 8;
+  uint len = st->len - 8;
+  png_info *pi = calloc(1, sizeof(png_info));
+  zstream *zs = calloc(1, sizeof(zstream));
+  uchar *idat = NULL;
+  size_t idatlen = 0;
+  uchar *raw = NULL;
+  bool ok = false;
+  bool header = false;
+
+  if (!pi || !zs)
+    goto end;
+
+  // collect the compressed data from the IDAT chunks
+  while (len >= 12) {
+    uint clen = be32(p);
+    const uchar *type = p + 4;
+    const uchar *data = p + 8;
+    if (clen > len - 12)
+      goto end;
+    if (!memcmp(type, "IHDR", 4)) {
+      if (!png_header(pi, data, clen))
+        goto end;
+      header = true;
+    }
+    else if (!header)
+      goto end;
+    else if (!memcmp(type, "PLTE", 4)) {
+      if (clen % 3 || clen > 3 * 256)
+        goto end;
+      pi->npalette = clen / 3;
+      for (int i = 0; i < pi->npalette; i++) {
+        memcpy(pi->palette[i], data + 3 * i, 3);
+        pi->palette[i][3] = 255;
+      }
+    }
+    else if (!memcmp(type, "tRNS", 4)) {
+      if (pi->ctype == 3) {
+        for (uint i = 0; i < clen && i < 256; i++)
+          pi->palette[i][3] = data[i];
+      }
+      else if (pi->ctype == 0 && clen >= 2) {
+        pi->key[0] = data[0] << 8 | data[1];
+        pi->has_key = true;
+      }
+      else if (pi->ctype == 2 && clen >= 6) {
+        for (int i = 0; i < 3; i++)
+          pi->key[i] = data[2 * i] << 8 | data[2 * i + 1];
+        pi->has_key = true;
+      }
+    }
+    else if (!memcmp(type, "IDAT", 4)) {
+      uchar *newidat = realloc(idat, idatlen + clen);
+      if (!newidat)
+        goto end;
+      idat = newidat;
+      memcpy(idat + idatlen, data, clen);
+      idatlen += clen;
+    }
+    else if (!memcmp(type, "IEND", 4))
+      break;
+    p += clen + 12;
+    len -= clen + 12;
+  }
+  if (!header || idatlen < 2 || (pi->ctype == 3 && !pi->npalette))
+    goto end;
+
+  // zlib header: deflate, no preset dictionary
+  if ((idat[0] & 15) != 8 || (idat[0] << 8 | idat[1]) % 31 || idat[1] & 32)
+    goto end;
+
+  const uchar (*passes)[4] = pi->interlaced ? adam7 : single;
+  int npasses = pi->interlaced ? 7 : 1;
+  int w = pi->width, h = pi->height;
+  uint pixelbits = pi->channels * pi->depth;
+  uint bpp = max(1, pixelbits / 8);
+  size_t rawlen = 0;
+  for (int i = 0; i < npasses; i++) {
+    int pw = (w - passes[i][0] + passes[i][2] - 1) / passes[i][2];
+    int ph = (h - passes[i][1] + passes[i][3] - 1) / passes[i][3];
+    if (pw > 0 && ph > 0)
+      rawlen += (size_t)ph * (1 + ((size_t)pw * pixelbits + 7) / 8);
+  }
+
+  raw = malloc(rawlen);
+  st->pixels = malloc((size_t)w * h * sizeof(uint));
+  if (!raw || !st->pixels)
+    goto end;
+  zs->in = idat + 2;
+  zs->inlen = idatlen - 2;
+  zs->out = raw;
+  zs->outlen = rawlen;
+  if (!zinflate(zs))
+    goto end;
+
+  uint bg = colour_bgra(st->bgcolor);
+  uchar *row = raw;
+  for (int i = 0; i < npasses; i++) {
+    int x0 = passes[i][0], y0 = passes[i][1];
+    int dx = passes[i][2], dy = passes[i][3];
+    int pw = (w - x0 + dx - 1) / dx;
+    int ph = (h - y0 + dy - 1) / dy;
+    if (pw <= 0 || ph <= 0)
+      continue;
+    uint rowbytes = ((size_t)pw * pixelbits + 7) / 8;
+    const uchar *prev = NULL;
+    for (int y = 0; y < ph; y++) {
+      if (!png_unfilter(row + 1, prev, rowbytes, bpp))
+        goto end;
+      png_convert(pi, row + 1, pw,
+                  st->pixels + (size_t)(y0 + y * dy) * w + x0, dx, bg);
+      prev = row + 1;
+      row += 1 + rowbytes;
+    }
+  }
+  st->image_width = w;
+  st->image_height = h;
+  ok = true;
+
+end:
+  if (!ok) {
+    free(st->pixels);
+    st->pixels = NULL;
+  }
+  free(raw);
+  free(idat);
+  free(zs);
+  free(pi);
+  return ok;
+}
+
+
+// BMP
+
+static inline uint
+mask_scale(uint px, uint mask)
+{
+  if (!mask)
+    return 0;
+  int shift = __builtin_ctz(mask);
+  uint max = mask >> shift;
+  return (unsigned long long)((px & mask) >> shift) * 255 / max;
+}
+
+static bool
+bmp_decode(imgfile_state *st)
+{
+  const uchar *p = st->data;
+  uint len = st->len;
+  int w, h;
+  uint bpp, comp = 0, ncolours = 0, palentry;
+  uint masks[4] = {0, 0, 0, 0};
+
+  if (len < 26)
+    return false;
+  uint off = le32(p + 10);
+  uint hsize = le32(p + 14);
+  if (hsize == 12) {  // BITMAPCOREHEADER
+    w = le16(p + 18);
+    h = (short)le16(p + 20);
+    bpp = le16(p + 24);
+    palentry = 3;
+  }
+  else if (hsize >= 40 && len >= 54 && hsize <= len - 14) {
+    w = le32(p + 18);
+    h = le32(p + 22);
+    bpp = le16(p + 28);
+    comp = le32(p + 30);
+    ncolours = le32(p + 46);
+    palentry = 4;
+    if (comp == 3 || comp == 6) {  // BI_BITFIELDS, BI_ALPHABITFIELDS
+      if (len < 66)
+        return false;
+      masks[0] = le32(p + 54);
+      masks[1] = le32(p + 58);
+      masks[2] = le32(p + 62);
+      if ((hsize >= 56 || comp == 6) && len >= 70)
+        masks[3] = le32(p + 66);
+    }
+    else if (comp)
+      return false;  // compressed
+  }
+  else
+    return false;
+
+  bool topdown = h < 0;
+  if (topdown)
+    h = -h;
+  if (!image_size_ok(w, h))
+    return false;
+
+  const uchar *pal = p + 14 + hsize;
+  switch (bpp) {
+    when 1 or 4 or 8:
+      if (!ncolours)
+        ncolours = 1 << bpp;
+      if (ncolours > 256 || 14 + hsize + ncolours * palentry > len)
+        return false;
+    when 16:
+      if (!comp) {
+        masks[0] = 0x7c00;
+        masks[1] = 0x03e0;
+        masks[2] = 0x001f;
+      }
+    when 24:
+      ;
+    when 32:
+      if (!comp) {
+        masks[0] = 0xff0000;
+        masks[1] = 0x00ff00;
+        masks[2] = 0x0000ff;
+      }
+    otherwise:
+      return false;
+  }
+
+  size_t stride = ((size_t)w * bpp + 31) / 32 * 4;
+  if (off > len || stride * h > len - off)
+    return false;
+  st->pixels = malloc((size_t)w * h * sizeof(uint));
+  if (!st->pixels)
+    return false;
+
+  uint bg = colour_bgra(st->bgcolor);
+  for (int y = 0; y < h; y++) {
+    const uchar *s = p + off + (topdown ? y : h - 1 - y) * stride;
+    uint *out = st->pixels + (size_t)y * w;
+    for (int x = 0; x < w; x++) {
+      uint r, g, b, a = 255;
+      switch (bpp) {
+        when 1 or 4 or 8: {
+          uint bit = x * bpp;
+          uint i = s[bit >> 3] >> (8 - bpp - (bit & 7)) & ((1 << bpp) - 1);
+          const uchar *c = pal + (i < ncolours ? i : 0) * palentry;
+          b = c[0];
+          g = c[1];
+          r = c[2];
+        }
+        when 24:
+          b = s[3 * x];
+          g = s[3 * x + 1];
+          r = s[3 * x + 2];
+        otherwise: {
+          uint px = bpp == 16 ? le16(s + 2 * x) : le32(s + 4 * x);
+          r = mask_scale(px, masks[0]);
+          g = mask_scale(px, masks[1]);
+          b = mask_scale(px, masks[2]);
+          if (masks[3])
+            a = mask_scale(px, masks[3]);
+        }
+      }
+      out[x] = blend(r, g, b, a, bg);
+    }
+  }
+  st->image_width = w;
+  st->image_height = h;
+  return true;
+}
+
+
+// OSC 1337 File= protocol
+
+static bool
+parse_size(const char *s, imgfile_size *size)
+{
+  char *end;
+  long n;
+
+  size->unit = 0;
+  if (!strcmp(s, "auto"))
+    return true;
+  n = strtol(s, &end, 10);
+  if (end == s || n < 0)
+    return false;
+  if (!*end)
+    size->unit = 'c';
+  else if (!strcmp(end, "px"))
+    size->unit = 'p';
+  else if (!strcmp(end, "%"))
+    size->unit = '%';
+  else
+    return false;
+  size->value = min(n, 100000);
+  if (!n)
+    size->unit = 0;
+  return true;
+}
+
+// pixel size requested by a File= width or height argument, or 0
+static int
+target_size(imgfile_size *size, int cell, int screen, int max)
+{
+  long long px;
+
+  switch (size->unit) {
+    when 'c': px = (long long)size->value * cell;
+    when 'p': px = size->value;
+    when '%': px = (long long)size->value * screen / 100;
+    otherwise: return 0;
+  }
+  return px > max ? max : px;
+}
+
+/*
+ * Start receiving a file from the OSC 1337 arguments up to the ':'.
+ * Returns NULL unless this is an inline image.
+ */
+imgfile_state *
+imgfile_start(const char *args, colour bgcolor)
+{
+  imgfile_state *st;
+  imgfile_size width = {0, 0}, height = {0, 0};
+  bool keep_aspect = true;
+  bool show = false;
+  uint size = 0;
+
+  if (strncmp(args, "File=", 5))
+    return NULL;
+  args += 5;
+
+  while (*args) {
+    int n = strcspn(args, ";");
+    const char *eq = memchr(args, '=', n);
+    if (eq) {
+      int klen = eq - args;
+      char val[32];
+      int vlen = min(n - klen - 1, (int)sizeof val - 1);
+      memcpy(val, eq + 1, vlen);
+      val[vlen] = 0;
+      if (klen == 6 && !strncmp(args, "inline", 6))
+        show = atoi(val);
+      else if (klen == 4 && !strncmp(args, "size", 4))
+        size = strtoul(val, NULL, 10);
+      else if (klen == 5 && !strncmp(args, "width", 5))
+        parse_size(val, &width);
+      else if (klen == 6 && !strncmp(args, "height", 6))
+        parse_size(val, &height);
+      else if (klen == 19 && !strncmp(args, "preserveAspectRatio", 19))
+        keep_aspect = atoi(val);
+    }
+    args += n;
+    if (*args)
+      args++;
+  }
+
+  // files not to be shown inline are downloads, which are not supported
+  if (!show || size > IMGFILE_DATA_MAX)
+    return NULL;
+
+  st = calloc(1, sizeof(imgfile_state));
+  if (!st)
+    return NULL;
+  base64_stream_init(&st->b64);
+  st->spec_width = width;
+  st->spec_height = height;
+  st->keep_aspect = keep_aspect;
+  st->bgcolor = bgcolor;
+  if (size) {
+    st->cap = size + BASE64_STREAM_OLEN(0);
+    st->data = malloc(st->cap);
+    if (!st->data)
+      st->cap = 0;
+  }
+  return st;
+}
+
+static void
+imgfile_fail(imgfile_state *st)
+{
+  free(st->data);
+  st->data = NULL;
+  st->len = st->cap = 0;
+  st->failed = true;
+}
+
+/*
+ * Decode the next piece of the base64 file contents.
+ */
+void
+imgfile_write(imgfile_state *st, const char *s, uint len)
+{
+  if (st->failed)
+    return;
+
+  size_t need = st->len + (size_t)BASE64_STREAM_OLEN(len);
+  if (need > st->cap) {
+    if (st->len + len / 4 * 3 > IMGFILE_DATA_MAX) {
+      imgfile_fail(st);
+      return;
+    }
+    size_t cap = max(need, min((size_t)st->cap * 2,
+                               IMGFILE_DATA_MAX + (size_t)BASE64_STREAM_OLEN(0)));
+    uchar *data = realloc(st->data, cap);
+    if (!data) {
+      imgfile_fail(st);
+      return;
+    }
+    st->data = data;
+    st->cap = cap;
+  }
+
+  int n = base64_decode_stream(&st->b64, s, len, (char *)st->data + st->len);
+  if (n < 0)
+    imgfile_fail(st);
+  else
+    st->len += n;
+}
+
+/*
+ * Decode the received file, and determine the placement of the image.
+ */
+bool
+imgfile_finish(imgfile_state *st)
+{
+  if (st->failed || !st->data)
+    return false;
+  // the buffer always has room for the rest of an unpadded group
+  int n = base64_stream_finish(&st->b64, (char *)st->data + st->len);
+  if (n < 0)
+    return false;
+  st->len += n;
+
+  bool ok = false;
+  if (st->len > 8 && !memcmp(st->data, "\x89PNG\r\n\x1a\n", 8))
+    ok = png_decode(st);
+  else if (st->len > 2 && !memcmp(st->data, "BM", 2))
+    ok = bmp_decode(st);
+  free(st->data);
+  st->data = NULL;
+  if (!ok)
+    return false;
+
+  int cw = st->grid_width = cell_width;
+  int ch = st->grid_height = cell_height;
+  int iw = st->image_width, ih = st->image_height;
+  long long tw = target_size(&st->spec_width, cw, term.cols * cw,
+                             IMGFILE_WIDTH_MAX);
+  long long th = target_size(&st->spec_height, ch, term.rows * ch,
+                             IMGFILE_HEIGHT_MAX);
+  if (!tw && !th) {
+    tw = iw;
+    th = ih;
+  }
+  else if (!tw)
+    tw = th * iw / ih;
+  else if (!th)
+    th = tw * ih / iw;
+  else if (st->keep_aspect) {
+    // fit into the requested box
+    if (tw * ih > th * iw)
+      tw = th * iw / ih;
+    else
+      th = tw * ih / iw;
+  }
+  tw = max(1, min(tw, IMGFILE_WIDTH_MAX));
+  th = max(1, min(th, IMGFILE_HEIGHT_MAX));
+
+  // Cover whole cells, padding the image with background rather than
+  // stretching it, unless that would need an oversized bitmap.
+  st->width = (tw + cw - 1) / cw;
+  st->height = (th + ch - 1) / ch;
+  st->pixelwidth = st->width * cw * iw / tw;
+  st->pixelheight = st->height * ch * ih / th;
+  if (st->pixelwidth > IMGFILE_WIDTH_MAX)
+    st->pixelwidth = iw;
+  if (st->pixelheight > IMGFILE_HEIGHT_MAX)
+    st->pixelheight = ih;
+  return true;
+}
+
+const uint *
+imgfile_get_row(imgfile_state *st, int y, uint *pixels)
+{
+  int x = 0;
+
+  if (y < st->image_height) {
+    const uint *src = st->pixels + (size_t)y * st->image_width;
+    if (st->pixelwidth == st->image_width)
+      return src;
+    memcpy(pixels, src, st->image_width * sizeof(uint));
+    x = st->image_width;
+  }
+  uint bg = colour_bgra(st->bgcolor);
+  for (; x < st->pixelwidth; x++)
+    pixels[x] = bg;
+  return pixels;
+}
+
+void
+imgfile_destroy(imgfile_state *st)
+{
+  if (st) {
+    free(st->data);
+    free(st->pixels);
+    free(st);
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef IMGFILE_H
+#define IMGFILE_H
+
+#include "config.h"
+#include "base64.h"
+
+#define IMGFILE_DATA_MAX (64 * 1024 * 1024)
+#define IMGFILE_WIDTH_MAX 16384
+#define IMGFILE_HEIGHT_MAX 16384
+#define IMGFILE_PIXELS_MAX (16 * 1024 * 1024)
+
+// requested image dimension: cells, 'p'ixels, '%' of the terminal, or auto
+typedef struct {
+  int value;
+  char unit;
+} imgfile_size;
+
+typedef struct {
+  // file contents, decoded from base64 as they arrive
+  base64_stream b64;
+  uchar *data;
+  uint len;
+  uint cap;
+  bool failed;
+
+  // File= arguments
+  imgfile_size spec_width;
+  imgfile_size spec_height;
+  bool keep_aspect;
+  colour bgcolor;
+
+  // decoded image (BGRA) and its placement
+  uint *pixels;
+  int image_width;
+  int image_height;
+  int pixelwidth;   // image padded to whole cells
+  int pixelheight;
+  int width;        // in cells
+  int height;
+  int grid_width;
+  int grid_height;
+} imgfile_state;
+
+imgfile_state * imgfile_start(const char *args, colour bgcolor);
+void imgfile_write(imgfile_state *st, const char *s, uint len);
+bool imgfile_finish(imgfile_state *st);
+const uint * imgfile_get_row(imgfile_state *st, int y, uint *pixels);
+void imgfile_destroy(imgfile_state *st);
+
+#endif
@@ -0,0 +1,206 @@
+// latency.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// Input-to-screen latency statistics (option LatencyStats).
+// A key press starts a probe that is timestamped as it passes the stages
+// in latency_stage: the echoed bytes are taken to be the first output read
+// after the key was sent, and they are on screen with the next frame that
+// draws anything. The time between stages is collected in histograms,
+// which are reported with OSC 7775 and written to the LatencyStats file
+// on exit.
+
+#include "latency.h"
+
+#include "config.h"
+#include "charset.h"  // path_win_w_to_posix
+
+#include <time.h>
+
+#define LAT_PROBE_MAX 1000000  // microseconds until a probe is dropped
+
+// Histogram buckets have a resolution of 1/8 of a power of 2 microseconds.
+#define LAT_SUB_BITS 3
+#define LAT_BUCKETS (32 << LAT_SUB_BITS)
+
+typedef struct {
+  uint count;
+  uint max;
+  uint buckets[LAT_BUCKETS];
+} histogram;
+
+// Stage latency, from the previous stage, and total latency at LAT_KEY.
+static histogram hists[LAT_STAGES];
+static const char * hist_names[LAT_STAGES] = {
+  "total", "key-send", "send-read", "read-write", "write-paint"
+};
+
+static uint frames, skipped_frames;
+
+static long long probe[LAT_STAGES];
+static int probe_stage = -1;  // last stage reached, or -1
+
+static bool enabled, checked;
+
+static long long
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+write_report(void)
+{
+  char * rep = latency_report(false);
+  if (0 == wcscmp(cfg.latency_stats, W("-")))
+    fputs(rep, stdout);
+  else {
+    char * filename = path_win_w_to_posix(cfg.latency_stats);
+    FILE * f = fopen(filename, "a");
+    if (f) {
+      fputs(rep, f);
+      fclose(f);
+    }
+    free(filename);
+  }
+  free(rep);
+}
+
+static bool
+latency_enabled(void)
+{
+  if (!checked) {
+    checked = true;
+    enabled = *cfg.latency_stats;
+    if (enabled)
+      atexit(write_report);
+  }
+  return enabled;
+}
+
+static uint
+bucket(uint us)
+{
+  if (us < 1 << LAT_SUB_BITS)
+    return us;
+  int exp = 31 - __builtin_clz(us);
+  uint sub = (us >> (exp - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1);
+  return ((exp - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + sub;
+}
+
+/*
+ * The middle of the range of values in a bucket.
+ */
+static uint
+bucket_value(uint b)
+{
+  if (b < 1 << LAT_SUB_BITS)
+    return b;
+  int shift = (b >> LAT_SUB_BITS) - 1;
+  uint low = ((1 << LAT_SUB_BITS) + (b & ((1 << LAT_SUB_BITS) - 1))) << shift;
+  return low + (1 << shift) / 2;
+}
+
+static void
+add_sample(histogram * h, long long us)
+{
+  uint v = min(max(us, 0), UINT_MAX);
+  h->count++;
+  h->max = max(h->max, v);
+  h->buckets[bucket(v)]++;
+}
+
+static uint
+percentile(histogram * h, uint pc)
+{
+  uint rank = ((unsigned long long)h->count * pc + 99) / 100;
+  uint seen = 0;
+  for (uint b = 0; b < LAT_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen && seen >= rank)
+      return min(bucket_value(b), h->max);
+  }
+  return h->max;
+}
+
+void
+latency_mark(latency_stage stage)
+{
+  if (!latency_enabled())
+    return;
+
+  long long t = now_us();
+  if (probe_stage >= 0 && t - probe[LAT_KEY] > LAT_PROBE_MAX)
+    probe_stage = -1;
+
+  // A key press starts a new probe, unless one is already underway.
+  if (stage == LAT_KEY) {
+    if (probe_stage <= LAT_KEY) {
+      probe[LAT_KEY] = t;
+      probe_stage = LAT_KEY;
+    }
+    return;
+  }
+
+  if (probe_stage != (int)stage - 1)
+    return;
+  probe[stage] = t;
+  probe_stage = stage;
+  add_sample(&hists[stage], t - probe[stage - 1]);
+  if (stage == LAT_PAINT) {
+    add_sample(&hists[LAT_KEY], t - probe[LAT_KEY]);
+    probe_stage = -1;
+  }
+}
+
+void
+latency_frame(bool drawn)
+{
+  if (!latency_enabled())
+    return;
+  if (drawn) {
+    frames++;
+    latency_mark(LAT_PAINT);
+  }
+  else
+    skipped_frames++;
+}
+
+/*
+ * Report the statistics as a table, or in one line for OSC 7775:
+ * name=count,p50,p99,max;... in microseconds, then frames=painted,skipped.
+ * Returns 0 if they are not being collected.
+ */
+char *
+latency_report(bool oneline)
+{
+  if (!latency_enabled())
+    return 0;
+
+  char * rep = newn(char, 1024);
+  int n = 0;
+  if (!oneline)
+    n += sprintf(rep + n, "%-12s %7s %9s %9s %9s\n",
+                 "latency", "count", "p50 ms", "p99 ms", "max ms");
+  // stages first, then the total
+  for (int i = 1; i <= LAT_STAGES; i++) {
+    int s = i % LAT_STAGES;
+    histogram * h = &hists[s];
+    uint p50 = percentile(h, 50);
+    uint p99 = percentile(h, 99);
+    if (oneline)
+      n += sprintf(rep + n, "%s=%u,%u,%u,%u;",
+                   hist_names[s], h->count, p50, p99, h->max);
+    else
+      n += sprintf(rep + n, "%-12s %7u %9.3f %9.3f %9.3f\n",
+                   hist_names[s], h->count,
+                   p50 / 1000.0, p99 / 1000.0, h->max / 1000.0);
+  }
+  if (oneline)
+    sprintf(rep + n, "frames=%u,%u", frames, skipped_frames);
+  else
+    sprintf(rep + n, "frames       %7u painted, %u skipped\n",
+            frames, skipped_frames);
+  return rep;
+}
@@ -0,0 +1,18 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+// input-to-screen latency stages, in the order a key press passes them
+typedef enum {
+  LAT_KEY,    // key pressed (win_key_down)
+  LAT_SEND,   // sent to the child process (child_send)
+  LAT_READ,   // echo read from the pty (child_proc)
+  LAT_WRITE,  // echo processed (term_write)
+  LAT_PAINT,  // echo painted (do_update)
+  LAT_STAGES
+} latency_stage;
+
+extern void latency_mark(latency_stage);
+extern void latency_frame(bool drawn);
+extern char * latency_report(bool oneline);
+
+#endif
@@ -0,0 +1,434 @@
+// logfile.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// Session log writer.
+// Output to be logged is copied into a ring buffer, from which a writer
+// thread writes it in large batches, so that a slow log file does not hold
+// up the terminal. Optionally the log is gzip compressed on the fly, and
+// synced to disk periodically.
+
+#include "logfile.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#define LOG_RING_SIZE (4 * 1024 * 1024)
+#define LOG_BATCH_MIN (64 * 1024)    // below this, wait a bit for more output
+#define LOG_BATCH_DELAY 50000        // microseconds
+#define LOG_BATCH_MAX (1024 * 1024)  // written (and compressed) at once
+
+static int log_fd = -1;
+static bool log_compress;
+static int log_sync;
+static time_t last_sync;
+
+// The ring has free-running head and tail counters, each written by one
+// side; the mutex and conditions are used only for waiting when it is
+// empty (writer) or full (terminal).
+static char *ring;
+static uint ring_head;  // written by the terminal
+static uint ring_tail;  // written by the writer thread
+static int writer_waiting;
+static int space_waiting;
+static bool closing;
+static pthread_t writer;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+
+
+// gzip (RFC 1952) compression with LZ77 and the fixed deflate codes.
+// Each batch is compressed independently and ends with an empty stored
+// block, so that the log is complete up to the last batch written.
+
+#define GZ_WINDOW 32768
+#define GZ_HASH_BITS 15
+#define GZ_CHAIN 16
+#define GZ_NICE 64
+
+static uint crc_table[256];
+static uint crc;
+static uint isize;
+static ushort lit_code[288];  // fixed codes, bit-reversed for output
+static uchar lit_len[288];
+static int *hash_head;
+static int *hash_prev;
+static uchar *gz_out;
+static uint gz_len;
+static uint gz_bitbuf;
+static int gz_bitcnt;
+
+static inline void
+put_bits(uint v, int n)
+{
+  gz_bitbuf |= v << gz_bitcnt;
+  gz_bitcnt += n;
+  while (gz_bitcnt >= 8) {
+    gz_out[gz_len++] = gz_bitbuf;
+    gz_bitbuf >>= 8;
+    gz_bitcnt -= 8;
+  }
+}
+
+static void
+align_bits(void)
+{
+  if (gz_bitcnt)
+    put_bits(0, 8 - gz_bitcnt);
+}
+
+static inline void
+put_byte(uint b)
+{
+  gz_out[gz_len++] = b;
+}
+
+static void
+put_le32(uint v)
+{
+  for (int i = 0; i < 4; i++)
+    put_byte(v >> (8 * i) & 0xff);
+}
+
+static bool
+gz_init(void)
+{
+  for (uint i = 0; i < 256; i++) {
+    uint c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+  crc = 0xFFFFFFFF;
+  isize = 0;
+
+  for (int sym = 0; sym < 288; sym++) {
+    uint code, len;
+    if (sym < 144)
+      code = 0x30 + sym, len = 8;
+    else if (sym < 256)
+      code = 0x190 + sym - 144, len = 9;
+    else if (sym < 280)
+      code = sym - 256, len = 7;
+    else
+      code = 0xC0 + sym - 280, len = 8;
+    uint rev = 0;
+    for (uint i = 0; i < len; i++)
+      rev |= (code >> i & 1) << (len - 1 - i);
+    lit_code[sym] = rev;
+    lit_len[sym] = len;
+  }
+
+  hash_head = newn(int, 1 << GZ_HASH_BITS);
+  hash_prev = newn(int, GZ_WINDOW);
+  gz_out = newn(uchar, LOG_BATCH_MAX / 8 * 9 + 64);
+  if (!hash_head || !hash_prev || !gz_out)
+    return false;
+
+  // header: deflate, no flags, no time, Unix
+  static const uchar header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+  for (int i = 0; i < 10; i++)
+    put_byte(header[i]);
+  return true;
+}
+
+static inline void
+put_sym(uint sym)
+{
+  put_bits(lit_code[sym], lit_len[sym]);
+}
+
+static inline void
+put_match(uint len, uint dist)
+{
+  if (len == 258)
+    put_sym(285);
+  else {
+    uint x = len - 3;
+    if (x < 8)
+      put_sym(257 + x);
+    else {
+      int n = 31 - __builtin_clz(x);
+      put_sym(257 + 4 * (n - 1) + (x >> (n - 2) & 3));
+      put_bits(x & ((1 << (n - 2)) - 1), n - 2);
+    }
+  }
+
+  uint x = dist - 1;
+  uint code, extra = 0;
+  int n = 0;
+  if (x < 4)
+    code = x;
+  else {
+    n = 31 - __builtin_clz(x);
+    code = 2 * n + (x >> (n - 1) & 1);
+    n -= 1;
+    extra = x & ((1 << n) - 1);
+  }
+  uint rev = 0;
+  for (int i = 0; i < 5; i++)
+    rev |= (code >> i & 1) << (4 - i);
+  put_bits(rev, 5);
+  if (n)
+    put_bits(extra, n);
+}
+
+static inline uint
+gz_hash(const uchar *p)
+{
+  return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << GZ_HASH_BITS) - 1);
+}
+
+static void
+gz_compress(const uchar *in, uint n)
+{
+  for (uint i = 0; i < n; i++)
+    crc = crc_table[(crc ^ in[i]) & 0xff] ^ (crc >> 8);
+  isize += n;
+
+  memset(hash_head, 0xff, sizeof(int) << GZ_HASH_BITS);
+  put_bits(2, 3);  // fixed codes block
+
+  uint i = 0;
+  while (i < n) {
+    uint best = 0, dist = 0;
+    if (i + 3 <= n) {
+      uint h = gz_hash(in + i);
+      int cand = hash_head[h];
+      uint maxlen = min(258, n - i);
+      for (int chain = GZ_CHAIN; cand >= 0 && i - cand <= GZ_WINDOW && chain--;) {
+        const uchar *p = in + cand, *q = in + i;
+        if (p[best] == q[best]) {
+          uint len = 0;
+          while (len < maxlen && p[len] == q[len])
+            len++;
+          if (len > best) {
+            best = len;
+            dist = i - cand;
+            if (len >= GZ_NICE || len == maxlen)
+              break;
+          }
+        }
+        int next = hash_prev[cand & (GZ_WINDOW - 1)];
+        if (next >= cand)
+          break;
+        cand = next;
+      }
+      hash_prev[i & (GZ_WINDOW - 1)] = hash_head[h];
+      hash_head[h] = i;
+    }
+
+    if (best >= 3) {
+      put_match(best, dist);
+      // index the rest of the match
+      uint end = i + best;
+      for (i++; i < end; i++) {
+        if (i + 3 <= n) {
+          uint h = gz_hash(in + i);
+          hash_prev[i & (GZ_WINDOW - 1)] = hash_head[h];
+          hash_head[h] = i;
+        }
+      }
+    }
+    else
+      put_sym(in[i++]);
+  }
+  put_sym(256);
+
+  // empty stored block to align the output (like zlib's Z_SYNC_FLUSH)
+  put_bits(0, 3);
+  align_bits();
+  put_byte(0);
+  put_byte(0);
+  put_byte(0xFF);
+  put_byte(0xFF);
+}
+
+static void
+gz_finish(void)
+{
+  put_bits(3, 3);  // final fixed codes block
+  put_sym(256);
+  align_bits();
+  put_le32(~crc);
+  put_le32(isize);
+}
+
+
+static void
+write_all(const void *buf, uint len)
+{
+  const char *p = buf;
+  while (len) {
+    int n = write(log_fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;  // nothing sensible to do about log errors
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static void
+write_batch(const char *buf, uint len)
+{
+  if (log_compress) {
+    gz_compress((const uchar *)buf, len);
+    write_all(gz_out, gz_len);
+    gz_len = 0;
+  }
+  else
+    write_all(buf, len);
+
+  if (log_sync) {
+    time_t now = time(0);
+    if (now - last_sync >= log_sync) {
+      fsync(log_fd);
+      last_sync = now;
+    }
+  }
+}
+
+static void *
+log_writer(void *unused)
+{
+  (void)unused;
+  bool delayed = false;
+
+  for (;;) {
+    uint tail = ring_tail;
+    uint avail = __atomic_load_n(&ring_head, __ATOMIC_SEQ_CST) - tail;
+    bool done = __atomic_load_n(&closing, __ATOMIC_SEQ_CST);
+
+    if (!avail) {
+      if (done)
+        break;
+      pthread_mutex_lock(&ring_mutex);
+      __atomic_store_n(&writer_waiting, 1, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&ring_head, __ATOMIC_SEQ_CST) == tail &&
+             !__atomic_load_n(&closing, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&data_cond, &ring_mutex);
+      __atomic_store_n(&writer_waiting, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&ring_mutex);
+      continue;
+    }
+
+    // Collect a worthwhile batch, unless output is trickling in slowly.
+    if (avail < LOG_BATCH_MIN && !delayed && !done) {
+      usleep(LOG_BATCH_DELAY);
+      delayed = true;
+      continue;
+    }
+    delayed = false;
+
+    uint pos = tail & (LOG_RING_SIZE - 1);
+    uint len = min(avail, min(LOG_RING_SIZE - pos, LOG_BATCH_MAX));
+    write_batch(ring + pos, len);
+
+    __atomic_store_n(&ring_tail, tail + len, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&space_waiting, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&ring_mutex);
+      pthread_cond_signal(&space_cond);
+      pthread_mutex_unlock(&ring_mutex);
+    }
+  }
+
+  if (log_compress) {
+    gz_finish();
+    write_all(gz_out, gz_len);
+    gz_len = 0;
+  }
+  if (log_sync)
+    fsync(log_fd);
+  return 0;
+}
+
+static void
+forget_writer(void)
+{
+  // A forked child process has no writer thread.
+  ring = 0;
+}
+
+/*
+ * Start writing the log to the given file descriptor, in a writer thread.
+ * If this fails, the log is written directly.
+ */
+void
+logfile_start(int fd, bool compress, int sync_interval)
+{
+  log_fd = fd;
+  log_compress = compress && gz_init();
+  log_sync = sync_interval;
+  last_sync = time(0);
+
+  ring = malloc(LOG_RING_SIZE);
+  if (!ring || pthread_create(&writer, 0, log_writer, 0)) {
+    free(ring);
+    ring = 0;
+    // without the writer, write the log uncompressed
+    log_compress = false;
+    return;
+  }
+  pthread_atfork(0, 0, forget_writer);
+  atexit(logfile_stop);
+}
+
+void
+logfile_write(const char *buf, uint len)
+{
+  if (!ring) {
+    write_all(buf, len);
+    return;
+  }
+
+  while (len) {
+    uint head = ring_head;
+    uint tail = __atomic_load_n(&ring_tail, __ATOMIC_SEQ_CST);
+    uint space = LOG_RING_SIZE - (head - tail);
+    if (!space) {
+      // The log cannot keep up; wait rather than lose output.
+      pthread_mutex_lock(&ring_mutex);
+      __atomic_store_n(&space_waiting, 1, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&ring_tail, __ATOMIC_SEQ_CST) == tail)
+        pthread_cond_wait(&space_cond, &ring_mutex);
+      __atomic_store_n(&space_waiting, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&ring_mutex);
+      continue;
+    }
+
+    uint pos = head & (LOG_RING_SIZE - 1);
+    uint n = min(len, min(space, LOG_RING_SIZE - pos));
+    memcpy(ring + pos, buf, n);
+    __atomic_store_n(&ring_head, head + n, __ATOMIC_SEQ_CST);
+    buf += n;
+    len -= n;
+
+    if (__atomic_load_n(&writer_waiting, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&ring_mutex);
+      pthread_cond_signal(&data_cond);
+      pthread_mutex_unlock(&ring_mutex);
+    }
+  }
+}
+
+/*
+ * Write out the rest of the log, and complete a compressed log.
+ */
+void
+logfile_stop(void)
+{
+  if (!ring)
+    return;
+  pthread_mutex_lock(&ring_mutex);
+  __atomic_store_n(&closing, true, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&data_cond);
+  pthread_mutex_unlock(&ring_mutex);
+  pthread_join(writer, 0);
+  free(ring);
+  ring = 0;
+}
@@ -0,0 +1,8 @@
+#ifndef LOGFILE_H
+#define LOGFILE_H
+
+extern void logfile_start(int fd, bool compress, int sync_interval);
+extern void logfile_write(const char *buf, uint len);
+extern void logfile_stop(void);
+
+#endif
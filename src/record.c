@@ -0,0 +1,343 @@
+// record.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// Session recording and replay.
+// A recording is a log file (option LogRecording) in which terminal output
+// is stored in timestamped records, together with terminal size changes
+// and, every REC_KEYFRAME_BYTES of output, a keyframe of the terminal
+// state. Replaying (option --replay) feeds the output back through
+// term_write at its original pace; seeking restores the nearest keyframe
+// and replays only the output after it.
+
+#include "record.h"
+
+#include "term.h"
+#include "win.h"
+#include "winpriv.h"  // win_prefix_title, win_unprefix_title
+#include "winimg.h"
+#include "logfile.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <winuser.h>
+
+/*
+ * File format (native byte order): REC_MAGIC, then records, each a
+ * rec_header followed by its data:
+ *   REC_OUTPUT:   terminal output
+ *   REC_SIZE:     the new terminal size as two ints, rows and columns
+ *   REC_KEYFRAME: terminal state after the preceding output,
+ *                 see term_save_keyframe
+ */
+#define REC_MAGIC "mintty recording\x1a\x01"
+#define REC_KEYFRAME_BYTES (256 * 1024)
+
+enum { REC_OUTPUT = 'O', REC_SIZE = 'S', REC_KEYFRAME = 'K' };
+
+typedef struct {
+  uchar type;
+  uchar reserved[3];
+  uint time;    // milliseconds since start of recording
+  uint len;     // length of data following
+} rec_header;
+
+
+static bool recording;
+static int rec_start_tick;
+static uint since_keyframe;
+static bool keyframe_due;
+
+static void
+put_record(uchar type, const void *data, uint len)
+{
+  rec_header hdr = {
+    .type = type,
+    .time = get_tick_count() - rec_start_tick,
+    .len = len
+  };
+  logfile_write((const char *)&hdr, sizeof hdr);
+  logfile_write(data, len);
+}
+
+/*
+ * Start recording, or resume it after logging was toggled off,
+ * with a keyframe as soon as possible.
+ */
+void
+record_start(void)
+{
+  if (!recording) {
+    recording = true;
+    rec_start_tick = get_tick_count();
+    logfile_write(REC_MAGIC, sizeof REC_MAGIC - 1);
+  }
+  keyframe_due = true;
+}
+
+void
+record_output(const char *buf, uint len)
+{
+  put_record(REC_OUTPUT, buf, len);
+  since_keyframe += len;
+
+  // A keyframe can only be taken between complete sequences and
+  // characters, as replay starts after it with a fresh parser.
+  if ((keyframe_due || since_keyframe >= REC_KEYFRAME_BYTES)
+      && term.state == NORMAL && !term.in_mb_char && !term.high_surrogate
+      && !term.inbuf_pos && !term.printing) {
+    uint size;
+    uchar *keyframe = term_save_keyframe(&size);
+    put_record(REC_KEYFRAME, keyframe, size);
+    free(keyframe);
+    since_keyframe = 0;
+    keyframe_due = false;
+  }
+}
+
+void
+record_resize(int rows, int cols)
+{
+  put_record(REC_SIZE, (int[]){rows, cols}, 2 * sizeof(int));
+  keyframe_due = true;
+}
+
+
+bool replaying;
+
+static uchar *rec_data;
+static uint rec_size;
+static uint rec_end_time;
+
+typedef struct {
+  uint time;
+  uint pos;  // of the record header
+} keyframe_index;
+
+static keyframe_index *keyframes;
+static uint keyframes_len;
+
+static uint play_pos;     // next record to play
+static uint play_time;    // recording time reached
+static int base_tick;     // when play_time was last set
+static int speed_shift;   // playback speed as a power of 2
+static bool paused;
+
+static inline rec_header
+get_header(uint pos)
+{
+  rec_header hdr;
+  memcpy(&hdr, rec_data + pos, sizeof hdr);
+  return hdr;
+}
+
+/*
+ * Map the recording and index its keyframes.
+ */
+bool
+replay_open(const char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof REC_MAGIC - 1
+      && st.st_size < 0xFFFFFFFF)
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  if (memcmp(map, REC_MAGIC, sizeof REC_MAGIC - 1)) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  rec_data = map;
+  uint size = st.st_size;
+
+  // Index the keyframes; a truncated last record is ignored.
+  uint cap = 0;
+  uint pos = sizeof REC_MAGIC - 1;
+  while (size - pos >= sizeof(rec_header)) {
+    rec_header hdr = get_header(pos);
+    if (hdr.len > size - pos - sizeof hdr)
+      break;
+    if (hdr.type == REC_KEYFRAME) {
+      if (keyframes_len == cap) {
+        cap = cap * 2 + 64;
+        keyframes = renewn(keyframes, cap);
+      }
+      keyframes[keyframes_len++] = (keyframe_index){hdr.time, pos};
+    }
+    rec_end_time = hdr.time;
+    pos += sizeof hdr + hdr.len;
+  }
+  rec_size = pos;
+
+  replaying = true;
+  play_pos = sizeof REC_MAGIC - 1;
+  return true;
+}
+
+static void
+play_record(rec_header hdr, const uchar *data)
+{
+  switch (hdr.type) {
+    when REC_OUTPUT:
+      term_write((const char *)data, hdr.len);
+    when REC_SIZE:
+      if (hdr.len == 2 * sizeof(int)) {
+        int size[2];
+        memcpy(size, data, sizeof size);
+        win_set_chars(size[0], size[1]);
+      }
+    // keyframes are only needed for seeking
+  }
+}
+
+/*
+ * Play the records up to the given recording time.
+ */
+static void
+play_until(uint time)
+{
+  while (play_pos < rec_size) {
+    rec_header hdr = get_header(play_pos);
+    if (hdr.time > time)
+      break;
+    play_record(hdr, rec_data + play_pos + sizeof hdr);
+    play_pos += sizeof hdr + hdr.len;
+  }
+  play_time = min(time, rec_end_time);
+  base_tick = get_tick_count();
+}
+
+static uint
+elapsed(void)
+{
+  uint ticks = get_tick_count() - base_tick;
+  return speed_shift >= 0 ? ticks << speed_shift : ticks >> -speed_shift;
+}
+
+static void
+set_paused(bool pause)
+{
+  if (pause == paused)
+    return;
+  paused = pause;
+  if (paused)
+    win_prefix_title(_W("[Paused] "));
+  else
+    win_unprefix_title(_W("[Paused] "));
+}
+
+static void
+replay_step(void)
+{
+  if (paused)
+    return;
+
+  play_until(play_time + elapsed());
+  if (play_pos >= rec_size) {
+    set_paused(true);
+    return;
+  }
+
+  uint wait = get_header(play_pos).time - play_time;
+  wait = speed_shift >= 0 ? wait >> speed_shift : wait << -speed_shift;
+  win_set_timer(replay_step, max(1, wait));
+}
+
+void
+replay_start(void)
+{
+  play_until(0);
+  win_set_timer(replay_step, 1);
+}
+
+/*
+ * Seek to the given recording time: restore the last keyframe before it,
+ * unless that is behind the current position anyway, and replay the
+ * output from there.
+ */
+static void
+replay_seek(int time)
+{
+  uint target = max(0, min(time, (int)rec_end_time));
+
+  // binary search for the last keyframe at or before the target
+  uint lo = 0, hi = keyframes_len;
+  while (lo < hi) {
+    uint mid = (lo + hi) / 2;
+    if (keyframes[mid].time <= target)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (target < play_time || (lo && keyframes[lo - 1].pos >= play_pos)) {
+    winimgs_clear();
+    term_reset();
+    play_pos = sizeof REC_MAGIC - 1;
+    if (lo) {
+      uint pos = keyframes[lo - 1].pos;
+      rec_header hdr = get_header(pos);
+      term_restore_keyframe(rec_data + pos + sizeof hdr, hdr.len);
+      play_pos = pos + sizeof hdr + hdr.len;
+    }
+  }
+  play_until(target);
+  win_update();
+
+  if (!paused)
+    replay_step();
+}
+
+/*
+ * Playback control keys, without modifiers:
+ * Space pauses or resumes, Left/Right seek by 5 seconds,
+ * PageUp/PageDown by a minute, Home/End to start/end,
+ * +/- double or halve the speed.
+ */
+bool
+replay_key(uint key)
+{
+  if (!replaying)
+    return false;
+
+  uint now = play_time + (paused ? 0 : elapsed());
+  switch (key) {
+    when VK_SPACE:
+      if (paused) {
+        // at the end, restart from the beginning
+        if (play_pos >= rec_size) {
+          replay_seek(0);
+          now = 0;
+        }
+        set_paused(false);
+        play_until(now);
+        replay_step();
+      }
+      else {
+        play_until(now);
+        set_paused(true);
+      }
+    when VK_LEFT:  replay_seek((int)now - 5000);
+    when VK_RIGHT: replay_seek(now + 5000);
+    when VK_PRIOR: replay_seek((int)now - 60000);
+    when VK_NEXT:  replay_seek(now + 60000);
+    when VK_HOME:  replay_seek(0);
+    when VK_END:   replay_seek(rec_end_time);
+    when VK_ADD or VK_OEM_PLUS:
+      play_until(now);
+      speed_shift = min(speed_shift + 1, 6);
+      replay_step();
+    when VK_SUBTRACT or VK_OEM_MINUS:
+      play_until(now);
+      speed_shift = max(speed_shift - 1, -3);
+      replay_step();
+    otherwise:
+      return false;
+  }
+  return true;
+}
@@ -0,0 +1,15 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+// session recording, written through the log file
+extern void record_start(void);
+extern void record_output(const char *buf, uint len);
+extern void record_resize(int rows, int cols);
+
+// replay of a session recording instead of running a child process
+extern bool replaying;
+extern bool replay_open(const char *filename);
+extern void replay_start(void);
+extern bool replay_key(uint key);
+
+#endif
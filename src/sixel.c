@@ -34,8 +34,20 @@ static colour const sixel_default_color_table[] = {
     SIXEL_XRGB(80, 80, 80),  /* 15 Gray 75% */
 };
 
-static int
-set_default_color(sixel_image_t *image)
+/*
+ * Palettes are shared between images and copied on write;
+ * the default palette is computed once. Entry 0 (background)
+ * is kept with the image, as it is set for each image.
+ */
+struct sixel_palette {
+  int refcount;
+  colour colours[DECSIXEL_PALETTE_MAX];
+};
+
+static sixel_palette_t *default_palette = NULL;
+
+static sixel_palette_t *
+get_default_palette(void)
 {
   int i;
   int n;
@@ -43,32 +55,98 @@ set_default_color(sixel_image_t *image)
   int g;
   int b;
 
-  /* palette initialization */
-  for (n = 1; n < 17; n++) {
-    image->palette[n] = sixel_default_color_table[n - 1];
-  }
+  if (!default_palette) {
+    default_palette = malloc(sizeof(sixel_palette_t));
+    if (!default_palette)
+      return NULL;
+    default_palette->refcount = 1;  /* kept */
+    default_palette->colours[0] = 0;
+
+    /* palette initialization */
+    for (n = 1; n < 17; n++) {
+      default_palette->colours[n] = sixel_default_color_table[n - 1];
+    }
 
-  /* colors 17-232 are a 6x6x6 color cube */
-  for (r = 0; r < 6; r++) {
-    for (g = 0; g < 6; g++) {
-      for (b = 0; b < 6; b++) {
-        image->palette[n++] = make_colour(r * 51, g * 51, b * 51);
+    /* colors 17-232 are a 6x6x6 color cube */
+    for (r = 0; r < 6; r++) {
+      for (g = 0; g < 6; g++) {
+        for (b = 0; b < 6; b++) {
+          default_palette->colours[n++] = make_colour(r * 51, g * 51, b * 51);
+        }
       }
     }
-  }
 
-  /* colors 233-256 are a grayscale ramp, intentionally leaving out */
-  for (i = 0; i < 24; i++) {
-    image->palette[n++] = make_colour(i * 11, i * 11, i * 11);
+    /* colors 233-256 are a grayscale ramp, intentionally leaving out */
+    for (i = 0; i < 24; i++) {
+      default_palette->colours[n++] = make_colour(i * 11, i * 11, i * 11);
+    }
+
+    for (; n < DECSIXEL_PALETTE_MAX; n++) {
+      default_palette->colours[n] = make_colour(255, 255, 255);
+    }
   }
 
-  for (; n < DECSIXEL_PALETTE_MAX; n++) {
-    image->palette[n] = make_colour(255, 255, 255);
+  default_palette->refcount++;
+  return default_palette;
+}
+
+static void
+palette_release(sixel_palette_t *palette)
+{
+  if (palette && --palette->refcount == 0)
+    free(palette);
+}
+
+static void
+palette_set(sixel_image_t *image, int n, colour color)
+{
+  sixel_palette_t *palette = image->palette;
+
+  if (!palette || palette->colours[n] == color)
+    return;
+
+  if (palette->refcount > 1) {
+    /* copy on write */
+    palette = malloc(sizeof(sixel_palette_t));
+    if (!palette)
+      return;
+    memcpy(palette->colours, image->palette->colours, sizeof(palette->colours));
+    palette->refcount = 1;
+    palette_release(image->palette);
+    image->palette = palette;
   }
+  palette->colours[n] = color;
+}
+
+static int
+set_default_color(sixel_image_t *image)
+{
+  sixel_palette_t *palette = get_default_palette();
+
+  if (!palette)
+    return (-1);
+  palette_release(image->palette);
+  image->palette = palette;
 
   return 0;
 }
 
+/*
+ * Image data is kept in tiles of SIXEL_TILE_SIZE x SIXEL_TILE_SIZE
+ * colour indexes, allocated when first drawn to; a missing tile is
+ * background. Growing the image thus only grows the tile directory,
+ * without copying pixel data.
+ */
+
+static sixel_color_no_t *
+image_tile(sixel_image_t *image, int tx, int ty)
+{
+  sixel_color_no_t **tile = &image->tiles[ty * image->tiles_x + tx];
+  if (!*tile)
+    *tile = calloc(SIXEL_TILE_SIZE * SIXEL_TILE_SIZE, sizeof(sixel_color_no_t));
+  return *tile;
+}
+
 static int
 sixel_image_init(
   sixel_image_t    *image,
@@ -79,25 +157,30 @@ sixel_image_init(
   int              use_private_register)
 {
   int status = (-1);
-  size_t size;
 
-  size = (size_t)(width * height) * sizeof(sixel_color_no_t);
   image->width = width;
   image->height = height;
-  image->data = (sixel_color_no_t *)malloc(size);
+  image->tiles_x = (width + SIXEL_TILE_SIZE - 1) / SIXEL_TILE_SIZE;
+  image->tiles_y = (height + SIXEL_TILE_SIZE - 1) / SIXEL_TILE_SIZE;
+  image->tiles = calloc(image->tiles_x * image->tiles_y, sizeof(sixel_color_no_t *));
+  image->bgra = NULL;
   image->ncolors = 2;
   image->use_private_register = use_private_register;
 
-  if (image->data == NULL) {
+  if (image->tiles == NULL) {
+    status = (-1);
+    goto end;
+  }
+
+  if (!image->palette && set_default_color(image) < 0) {
     status = (-1);
     goto end;
   }
-  memset(image->data, 0, size);
 
-  image->palette[0] = bgcolor;
+  image->bgcolor = bgcolor;
 
   if (image->use_private_register)
-    image->palette[1] = fgcolor;
+    palette_set(image, 1, fgcolor);
 
   image->palette_modified = 0;
 
@@ -107,6 +190,18 @@ end:
   return status;
 }
 
+static void
+sixel_image_deinit(sixel_image_t *image)
+{
+  if (image->tiles) {
+    for (int i = 0; i < image->tiles_x * image->tiles_y; i++)
+      free(image->tiles[i]);
+    free(image->tiles);
+  }
+  image->tiles = NULL;
+  free(image->bgra);
+  image->bgra = NULL;
+}
 
 static int
 image_buffer_resize(
@@ -115,53 +210,32 @@ image_buffer_resize(
   int              height)
 {
   int status = (-1);
-  size_t size;
-  sixel_color_no_t *alt_buffer;
-  int n;
-  int min_height;
-
-  size = (size_t)(width * height) * sizeof(sixel_color_no_t);
-  alt_buffer = (sixel_color_no_t *)malloc(size);
-  if (alt_buffer == NULL) {
-    /* free source image */
-    free(image->data);
-    image->data = NULL;
-    status = (-1);
-    goto end;
-  }
-
-  min_height = height > image->height ? image->height: height;
-  if (width > image->width) {  /* if width is extended */
-    for (n = 0; n < min_height; ++n) {
-      /* copy from source image */
-      memcpy(alt_buffer + width * n,
-             image->data + image->width * n,
-             (size_t)image->width * sizeof(sixel_color_no_t));
-      /* fill extended area with background color */
-      memset(alt_buffer + width * n + image->width,
-             0,
-             (size_t)(width - image->width) * sizeof(sixel_color_no_t));
-    }
-  } else {
-    for (n = 0; n < min_height; ++n) {
-      /* copy from source image */
-      memcpy(alt_buffer + width * n,
-             image->data + image->width * n,
-             (size_t)width * sizeof(sixel_color_no_t));
+  sixel_color_no_t **tiles;
+  int tiles_x = (width + SIXEL_TILE_SIZE - 1) / SIXEL_TILE_SIZE;
+  int tiles_y = (height + SIXEL_TILE_SIZE - 1) / SIXEL_TILE_SIZE;
+  int ty;
+
+  if (tiles_x > image->tiles_x || tiles_y > image->tiles_y) {
+    tiles_x = tiles_x > image->tiles_x ? tiles_x: image->tiles_x;
+    tiles_y = tiles_y > image->tiles_y ? tiles_y: image->tiles_y;
+    tiles = calloc(tiles_x * tiles_y, sizeof(sixel_color_no_t *));
+    if (tiles == NULL) {
+      /* free source image */
+      sixel_image_deinit(image);
+      status = (-1);
+      goto end;
     }
+    /* move tile pointers; extended area is background */
+    for (ty = 0; ty < image->tiles_y; ++ty)
+      memcpy(tiles + ty * tiles_x,
+             image->tiles + ty * image->tiles_x,
+             image->tiles_x * sizeof(sixel_color_no_t *));
+    free(image->tiles);
+    image->tiles = tiles;
+    image->tiles_x = tiles_x;
+    image->tiles_y = tiles_y;
   }
 
-  if (height > image->height) {  /* if height is extended */
-    /* fill extended area with background color */
-    memset(alt_buffer + width * image->height,
-           0,
-           (size_t)(width * (height - image->height)) * sizeof(sixel_color_no_t));
-  }
-
-  /* free source image */
-  free(image->data);
-
-  image->data = alt_buffer;
   image->width = width;
   image->height = height;
 
@@ -171,11 +245,26 @@ end:
   return status;
 }
 
+/* fill a row span of pixels with a colour index */
 static void
-sixel_image_deinit(sixel_image_t *image)
+fill_span(sixel_image_t *image, int x, int y, int n, sixel_color_no_t color)
 {
-  free(image->data);
-  image->data = NULL;
+  int ty = y / SIXEL_TILE_SIZE;
+  int offset = (y % SIXEL_TILE_SIZE) * SIXEL_TILE_SIZE;
+
+  while (n > 0) {
+    int tx = x / SIXEL_TILE_SIZE;
+    int tilex = x % SIXEL_TILE_SIZE;
+    int len = SIXEL_TILE_SIZE - tilex < n ? SIXEL_TILE_SIZE - tilex: n;
+    sixel_color_no_t *dst = image_tile(image, tx, ty);
+    if (!dst)
+      return;
+    dst += offset + tilex;
+    for (int i = 0; i < len; i++)
+      dst[i] = color;
+    x += len;
+    n -= len;
+  }
 }
 
 int
@@ -214,16 +303,14 @@ sixel_parser_set_default_color(sixel_state_t *st)
 }
 
 int
-sixel_parser_finalize(sixel_state_t *st, uchar *pixels)
+sixel_parser_finalize(sixel_state_t *st)
 {
   int status = (-1);
   int sx;
   int sy;
   sixel_image_t *image = &st->image;
-  int x, y;
-  sixel_color_no_t *src;
-  uchar *dst;
-  int color;
+  int i;
+  colour color;
 
   if (++st->max_x < st->attributed_ph) {
     st->max_x = st->attributed_ph;
@@ -236,7 +323,13 @@ sixel_parser_finalize(sixel_state_t *st, uchar *pixels)
   sx = (st->max_x + st->grid_width - 1) / st->grid_width * st->grid_width;
   sy = (st->max_y + st->grid_height - 1) / st->grid_height * st->grid_height;
 
-  if (image->width > sx || image->height > sy) {
+  /* the raster attributes (DECGRA) must not make the image exceed limits */
+  if (sx > DECSIXEL_WIDTH_MAX)
+    sx = DECSIXEL_WIDTH_MAX;
+  if (sy > DECSIXEL_HEIGHT_MAX)
+    sy = DECSIXEL_HEIGHT_MAX;
+
+  if (image->width != sx || image->height != sy) {
     status = image_buffer_resize(image, sx, sy);
     if (status < 0) {
       goto end;
@@ -250,34 +343,15 @@ sixel_parser_finalize(sixel_state_t *st, uchar *pixels)
     }
   }
 
-  src = st->image.data;
-  dst = pixels;
-  for (y = 0; y < st->image.height; ++y) {
-    for (x = 0; x < st->image.width; ++x) {
-      color = st->image.palette[*src++];
-      *dst++ = color >> 16 & 0xff;   /* b */
-      *dst++ = color >> 8 & 0xff;    /* g */
-      *dst++ = color >> 0 & 0xff;    /* r */
-      dst++;                         /* a */
-    }
-    /* fill right padding with bgcolor */
-    for (; x < st->image.width; ++x) {
-      color = st->image.palette[0];  /* bgcolor */
-      *dst++ = color >> 16 & 0xff;   /* b */
-      *dst++ = color >> 8 & 0xff;    /* g */
-      *dst++ = color >> 0 & 0xff;    /* r */
-      dst++;                         /* a */
-    }
+  /* palette index to BGRA lookup table */
+  image->bgra = malloc((image->ncolors + 1) * sizeof(uint));
+  if (!image->bgra) {
+    status = (-1);
+    goto end;
   }
-  /* fill bottom padding with bgcolor */
-  for (; y < st->image.height; ++y) {
-    for (x = 0; x < st->image.width; ++x) {
-      color = st->image.palette[0];  /* bgcolor */
-      *dst++ = color >> 16 & 0xff;   /* b */
-      *dst++ = color >> 8 & 0xff;    /* g */
-      *dst++ = color >> 0 & 0xff;    /* r */
-      dst++;                         /* a */
-    }
+  for (i = 0; i <= image->ncolors; ++i) {
+    color = i ? image->palette->colours[i]: image->bgcolor;
+    image->bgra[i] = (color >> 16 & 0xff) | (color & 0xff00) | (color & 0xff) << 16;
   }
 
   status = (0);
@@ -286,25 +360,49 @@ end:
   return status;
 }
 
+/* get a row of the finalized image as BGRA pixels */
+const uint *
+sixel_parser_get_row(sixel_state_t *st, int y, uint *pixels)
+{
+  sixel_image_t *image = &st->image;
+  int ty = y / SIXEL_TILE_SIZE;
+  int offset = (y % SIXEL_TILE_SIZE) * SIXEL_TILE_SIZE;
+  int x, i, len;
+  sixel_color_no_t *src;
+  uint *dst;
+
+  for (x = 0; x < image->width; x += SIXEL_TILE_SIZE) {
+    len = image->width - x < SIXEL_TILE_SIZE ? image->width - x: SIXEL_TILE_SIZE;
+    src = image->tiles[ty * image->tiles_x + x / SIXEL_TILE_SIZE];
+    dst = pixels + x;
+    if (src) {
+      src += offset;
+      for (i = 0; i < len; ++i)
+        dst[i] = image->bgra[src[i]];
+    } else {
+      /* background tile */
+      for (i = 0; i < len; ++i)
+        dst[i] = image->bgra[0];
+    }
+  }
+
+  return pixels;
+}
+
 /* convert sixel data into indexed pixel bytes and palette data */
 int
 sixel_parser_parse(sixel_state_t *st, uchar *p, size_t len)
 {
   int status = (-1);
-  int n;
   int i;
-  int x;
-  int y;
   int bits;
-  int sixel_vertical_mask;
   int sx;
   int sy;
   int c;
-  int pos;
   uchar *p0 = p;
   sixel_image_t *image = &st->image;
 
-  if (!image->data)
+  if (!image->tiles)
     goto end;
 
   while (p < p0 + len) {
@@ -380,51 +478,23 @@ sixel_parser_parse(sixel_state_t *st, uchar *p, size_t len)
             st->repeat_count = image->width - st->pos_x;
           }
 
-          if (st->repeat_count > 0 && st->pos_y - 5 < image->height) {
+          if (st->repeat_count > 0 && st->pos_y < image->height) {
             bits = *p - '?';
+            /* clip the band at the bottom of the image */
+            if (st->pos_y + 6 > image->height)
+              bits &= (1 << (image->height - st->pos_y)) - 1;
             if (bits != 0) {
-              sixel_vertical_mask = 0x01;
-              if (st->repeat_count <= 1) {
-                for (i = 0; i < 6; i++) {
-                  if ((bits & sixel_vertical_mask) != 0) {
-                    pos = image->width * (st->pos_y + i) + st->pos_x;
-                    image->data[pos] = st->color_index;
-                    if (st->max_x < st->pos_x) {
-                      st->max_x = st->pos_x;
-                    }
-                    if (st->max_y < (st->pos_y + i)) {
-                      st->max_y = st->pos_y + i;
-                    }
-                  }
-                  sixel_vertical_mask <<= 1;
-                }
-              } else {
-                /* st->repeat_count > 1 */
-                for (i = 0; i < 6; i++) {
-                  if ((bits & sixel_vertical_mask) != 0) {
-                    c = sixel_vertical_mask << 1;
-                    for (n = 1; (i + n) < 6; n++) {
-                      if ((bits & c) == 0) {
-                        break;
-                      }
-                      c <<= 1;
-                    }
-                    for (y = st->pos_y + i; y < st->pos_y + i + n; ++y) {
-                      for (x = st->pos_x; x < st->pos_x + st->repeat_count; ++x) {
-                        image->data[image->width * y + x] = st->color_index;
-                      }
-                    }
-                    if (st->max_x < (st->pos_x + st->repeat_count - 1)) {
-                      st->max_x = st->pos_x + st->repeat_count - 1;
-                    }
-                    if (st->max_y < (st->pos_y + i + n - 1)) {
-                      st->max_y = st->pos_y + i + n - 1;
-                    }
-                    i += (n - 1);
-                    sixel_vertical_mask <<= (n - 1);
-                  }
-                  sixel_vertical_mask <<= 1;
-                }
+              /* fill a span of repeat_count pixels in each row of the mask */
+              for (c = bits; c; c &= c - 1) {
+                i = __builtin_ctz(c);
+                fill_span(image, st->pos_x, st->pos_y + i,
+                          st->repeat_count, st->color_index);
+              }
+              if (st->max_x < (st->pos_x + st->repeat_count - 1)) {
+                st->max_x = st->pos_x + st->repeat_count - 1;
+              }
+              if (st->max_y < (st->pos_y + 31 - __builtin_clz(bits))) {
+                st->max_y = st->pos_y + 31 - __builtin_clz(bits);
               }
             }
           }
@@ -613,8 +683,8 @@ sixel_parser_parse(sixel_state_t *st, uchar *p, size_t len)
             if (st->params[4] > 100) {
               st->params[4] = 100;
             }
-            image->palette[st->color_index]
-              = hls_to_rgb(st->params[2], st->params[3], st->params[4]);
+            palette_set(image, st->color_index,
+                        hls_to_rgb(st->params[2], st->params[3], st->params[4]));
           } else if (st->params[1] == 2) {
             /* RGB */
             if (st->params[2] > 100) {
@@ -626,8 +696,8 @@ sixel_parser_parse(sixel_state_t *st, uchar *p, size_t len)
             if (st->params[4] > 100) {
               st->params[4] = 100;
             }
-            image->palette[st->color_index]
-              = SIXEL_XRGB(st->params[2], st->params[3], st->params[4]);
+            palette_set(image, st->color_index,
+                        SIXEL_XRGB(st->params[2], st->params[3], st->params[4]));
           }
         }
         break;
@@ -650,3 +720,13 @@ sixel_parser_deinit(sixel_state_t *st)
   if (st)
     sixel_image_deinit(&st->image);
 }
+
+void
+sixel_parser_destroy(sixel_state_t *st)
+{
+  if (st) {
+    sixel_image_deinit(&st->image);
+    palette_release(st->image.palette);
+    free(st);
+  }
+}
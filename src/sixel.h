@@ -6,16 +6,23 @@
 #define DECSIXEL_PARAMS_MAX 16
 #define DECSIXEL_PALETTE_MAX 1024
 #define DECSIXEL_PARAMVALUE_MAX 65535
-#define DECSIXEL_WIDTH_MAX 4096
-#define DECSIXEL_HEIGHT_MAX 4096
+#define DECSIXEL_WIDTH_MAX 16384
+#define DECSIXEL_HEIGHT_MAX 16384
+#define SIXEL_TILE_SIZE 128
 
 typedef ushort sixel_color_no_t;
 
+typedef struct sixel_palette sixel_palette_t;
+
 typedef struct sixel_image_buffer {
-  sixel_color_no_t *data;
+  sixel_color_no_t **tiles;  /* tile directory, row-major */
+  int tiles_x;
+  int tiles_y;
   int width;
   int height;
-  colour palette[DECSIXEL_PALETTE_MAX];
+  uint *bgra;                /* finalized palette as BGRA pixels */
+  colour bgcolor;
+  sixel_palette_t *palette;  /* shared, copied on write */
   sixel_color_no_t ncolors;
   int palette_modified;
   int use_private_register;
@@ -53,7 +60,9 @@ typedef struct parser_context {
 int sixel_parser_init(sixel_state_t *st, colour fgcolor, colour bgcolor, uchar use_private_register);
 int sixel_parser_parse(sixel_state_t *st, uchar *p, size_t len);
 int sixel_parser_set_default_color(sixel_state_t *st);
-int sixel_parser_finalize(sixel_state_t *st, uchar *pixels);
+int sixel_parser_finalize(sixel_state_t *st);
+const uint * sixel_parser_get_row(sixel_state_t *st, int y, uint *pixels);
 void sixel_parser_deinit(sixel_state_t *st);
+void sixel_parser_destroy(sixel_state_t *st);
 
 #endif
@@ -35,63 +35,85 @@ vt220(string term)
   return false;
 }
 
+/*
+ * Blink timers only run while something blinks on the screen:
+ * term_paint notes whether blinking text or a blinking cursor is visible,
+ * and arms the timers, which do not re-arm themselves.
+ * Nothing blinks while the window is unfocused or minimized.
+ */
+static bool tblink_visible, tblink2_visible, cblink_visible;
+static bool tblink_armed, tblink2_armed;
+
+static bool
+blinks_shown(void)
+{
+  return term.has_focus && !win_is_iconic();
+}
+
 /*
  * Call when the terminal's blinking-text settings change, or when
  * a text blink has just occurred.
  */
-static void term_schedule_tblink(void);
-static void term_schedule_tblink2(void);
-
 static void
 tblink_cb(void)
 {
+  tblink_armed = false;
   term.tblinker = !term.tblinker;
-  term_schedule_tblink();
   win_update();
 }
 
 static void
 term_schedule_tblink(void)
 {
-  if (term.blink_is_real)
-    win_set_timer(tblink_cb, 500);
+  if (term.blink_is_real && tblink_visible && blinks_shown()) {
+    if (!tblink_armed)
+      win_set_timer(tblink_cb, 500);
+    tblink_armed = true;
+  }
   else
-    term.tblinker = 1;  /* reset when not in use */
+    term.tblinker = 0;  /* reset when not in use */
 }
 
 static void
 tblink2_cb(void)
 {
+  tblink2_armed = false;
   term.tblinker2 = !term.tblinker2;
-  term_schedule_tblink2();
   win_update();
 }
 
 static void
 term_schedule_tblink2(void)
 {
-  if (term.blink_is_real)
-    win_set_timer(tblink2_cb, 300);
+  if (term.blink_is_real && tblink2_visible && blinks_shown()) {
+    if (!tblink2_armed)
+      win_set_timer(tblink2_cb, 300);
+    tblink2_armed = true;
+  }
   else
-    term.tblinker2 = 1;  /* reset when not in use */
+    term.tblinker2 = 0;  /* reset when not in use */
 }
 
 /*
- * Likewise with cursor blinks.
+ * Likewise with cursor blinks; scheduling restarts the blink period.
  */
+static bool cblink_armed;
+
 static void
 cblink_cb(void)
 {
+  cblink_armed = false;
   term.cblinker = !term.cblinker;
-  term_schedule_cblink();
   win_update();
 }
 
 void
 term_schedule_cblink(void)
 {
-  if (term_cursor_blinks() && term.has_focus)
+  if (term_cursor_blinks() && cblink_visible && blinks_shown()) {
     win_set_timer(cblink_cb, cursor_blink_ticks());
+    cblink_armed = true;
+  }
   else
     term.cblinker = 1;  /* reset when not in use */
 }
@@ -193,10 +215,9 @@ term_reset(void)
   term.virtuallines = 0;
   term.altvirtuallines = 0;
   term.imgs.parser_state = NULL;
-  term.imgs.first = NULL;
-  term.imgs.last = NULL;
-  term.imgs.altfirst = NULL;
-  term.imgs.altlast = NULL;
+  term.imgs.file_state = NULL;
+  term.imgs.index = NULL;
+  term.imgs.altindex = NULL;
   term.sixel_display = 0;
   term.sixel_scrolls_right = 0;
   term.sixel_scrolls_left = 0;
@@ -696,6 +717,299 @@ term_clear_scrollback(void)
   term.disptop = 0;
 }
 
+/*
+ * Session snapshot (option SessionFile): save the scrollback, which is
+ * stored compressed already, plus the compressed lines of the main screen
+ * up to the cursor, the cursor position and some modes; on startup,
+ * restore them so that the new session continues below the old contents.
+ *
+ * File format (native byte order), version SESSION_VERSION:
+ *   header: magic, version, number of lines, number of screen lines,
+ *           cursor x, flags
+ *   lines:  for each line (oldest first), its size and compressed data
+ */
+#define SESSION_MAGIC "mintty\x1a\x01"
+#define SESSION_VERSION 1
+enum { SESSION_RVIDEO = 1 };
+
+typedef struct {
+  char magic[8];
+  uint version;
+  int lines, scrlines;
+  int curs_x;
+  uint flags;
+} session_header;
+
+static char *
+session_filename(void)
+{
+  if (!*cfg.session_file)
+    return 0;
+  return path_win_w_to_posix(cfg.session_file);
+}
+
+void
+term_save_session(void)
+{
+  if (!term.lines)
+    return;
+  char * fn = session_filename();
+  if (!fn)
+    return;
+  FILE * sf = fopen(fn, "w");
+  free(fn);
+  if (!sf)
+    return;
+
+  // Save the main screen, also while the alternate screen is active
+  termlines * lines = term.on_alt_screen ? term.other_lines : term.lines;
+  term_cursor * curs =
+    term.on_alt_screen ? &term.saved_cursors[false] : &term.curs;
+  int scrlines = curs->y + 1;
+
+  session_header hdr = {
+    .magic = SESSION_MAGIC,
+    .version = SESSION_VERSION,
+    .lines = term.sblines + scrlines,
+    .scrlines = scrlines,
+    .curs_x = curs->x,
+    .flags = term.rvideo ? SESSION_RVIDEO : 0
+  };
+  bool ok = fwrite(&hdr, sizeof hdr, 1, sf) == 1;
+
+  bool save_line(uchar * cline) {
+    int size = compressedline_size(cline);
+    return fwrite(&size, sizeof size, 1, sf) == 1
+        && fwrite(cline, size, 1, sf) == 1;
+  }
+
+  for (int i = term.sblines; ok && i > 0; i--) {
+    int y = term.sbpos - i;
+    if (y < 0)
+      y += term.sblen;
+    ok = save_line(term.scrollback[y]);
+  }
+  for (int i = 0; ok && i < scrlines; i++) {
+    uchar * cline = compressline(lines[i]);
+    ok = save_line(cline);
+    free(cline);
+  }
+
+  fclose(sf);
+}
+
+void
+term_restore_session(void)
+{
+  char * fn = session_filename();
+  if (!fn)
+    return;
+  FILE * sf = fopen(fn, "r");
+  free(fn);
+  if (!sf)
+    return;
+
+ /*
+  * Read the whole file at once; scrollback lines are taken over in their
+  * compressed form, only the lines restored to the screen are decompressed.
+  */
+  fseek(sf, 0, SEEK_END);
+  long fsize = ftell(sf);
+  fseek(sf, 0, SEEK_SET);
+  uchar * data = fsize > 0 ? malloc(fsize) : 0;
+  if (data && fread(data, fsize, 1, sf) != 1) {
+    free(data);
+    data = 0;
+  }
+  fclose(sf);
+  if (!data)
+    return;
+
+  session_header hdr;
+  if ((size_t)fsize < sizeof hdr)
+    goto done;
+  memcpy(&hdr, data, sizeof hdr);
+  if (memcmp(hdr.magic, SESSION_MAGIC, sizeof hdr.magic)
+      || hdr.version != SESSION_VERSION
+      || hdr.scrlines <= 0 || hdr.scrlines > hdr.lines
+     )
+    goto done;
+
+  // Lines beyond the screen height go to the scrollback
+  int scrlines = min(hdr.scrlines, term.rows);
+  int sblines = hdr.lines - scrlines;
+  long p = sizeof hdr;
+  for (int i = 0; i < hdr.lines; i++) {
+    int size;
+    if (p + (long)sizeof size > fsize)
+      break;
+    memcpy(&size, data + p, sizeof size);
+    p += sizeof size;
+    if (size <= 0 || p + size > fsize)
+      break;
+    uchar * cline = data + p;
+    // drop the rest of a corrupt file
+    if (compressedline_check(cline, size) != size)
+      break;
+    p += size;
+
+    if (i < sblines) {
+      if (cfg.scrollback_lines) {
+        uchar * sbline = malloc(size);
+        memcpy(sbline, cline, size);
+        scrollback_push(sbline);
+      }
+    }
+    else {
+      int y = i - sblines;
+      termline * line = decompressline(cline, null);
+      line->temporary = false;
+      resizeline(line, term.cols);
+      freeline(term.lines[y]);
+      term.lines[y] = line;
+      term.curs.y = y;
+    }
+  }
+
+  term.curs.x = max(0, min(hdr.curs_x, term.cols - 1));
+  term.rvideo = hdr.flags & SESSION_RVIDEO;
+
+done:
+  free(data);
+}
+
+/*
+ * Keyframes of session recordings: both screens, the cursors and the
+ * modes that affect further output, so that seeking in a recording can
+ * restore the terminal state directly instead of replaying everything
+ * before it.
+ *
+ * Format (native byte order): header, tab stops, then the lines of the
+ * main and the alternate screen, each as its size and compressed data.
+ */
+typedef struct {
+  int rows, cols;
+  bool on_alt_screen;
+  term_cursor curs, saved_cursors[2];
+  int marg_top, marg_bot;
+  bool rvideo, cursor_on, insert, newline_mode;
+  bool app_cursor_keys, app_keypad, bracketed_paste;
+  int cursor_type;
+} keyframe_header;
+
+uchar *
+term_save_keyframe(uint * len)
+{
+  keyframe_header hdr = {
+    .rows = term.rows, .cols = term.cols,
+    .on_alt_screen = term.on_alt_screen,
+    .curs = term.curs,
+    .saved_cursors = {term.saved_cursors[0], term.saved_cursors[1]},
+    .marg_top = term.marg_top, .marg_bot = term.marg_bot,
+    .rvideo = term.rvideo, .cursor_on = term.cursor_on,
+    .insert = term.insert, .newline_mode = term.newline_mode,
+    .app_cursor_keys = term.app_cursor_keys, .app_keypad = term.app_keypad,
+    .bracketed_paste = term.bracketed_paste,
+    .cursor_type = term.cursor_type
+  };
+
+  uint cap = sizeof hdr + term.cols + term.rows * 2 * (sizeof(int) + 64);
+  uchar * data = newn(uchar, cap);
+  uint n = 0;
+  void add(const void * p, uint size) {
+    if (n + size > cap) {
+      cap = max(cap * 2, n + size);
+      data = renewn(data, cap);
+    }
+    memcpy(data + n, p, size);
+    n += size;
+  }
+
+  add(&hdr, sizeof hdr);
+  add(term.tabs, term.cols);
+  termlines * mainlines = term.on_alt_screen ? term.other_lines : term.lines;
+  termlines * altlines = term.on_alt_screen ? term.lines : term.other_lines;
+  for (int i = 0; i < term.rows * 2; i++) {
+    uchar * cline = compressline(i < term.rows ? mainlines[i] : altlines[i - term.rows]);
+    int size = compressedline_size(cline);
+    add(&size, sizeof size);
+    add(cline, size);
+    free(cline);
+  }
+
+  *len = n;
+  return data;
+}
+
+/*
+ * Restore a keyframe into the freshly reset terminal; if the terminal size
+ * differs from the recorded one, lines are cut or padded.
+ */
+bool
+term_restore_keyframe(const uchar * data, uint len)
+{
+  keyframe_header hdr;
+  if (len < sizeof hdr)
+    return false;
+  memcpy(&hdr, data, sizeof hdr);
+  if (hdr.rows <= 0 || hdr.cols <= 0 || len < sizeof hdr + hdr.cols)
+    return false;
+
+  uint p = sizeof hdr;
+  memcpy(term.tabs, data + p, min(hdr.cols, term.cols));
+  p += hdr.cols;
+
+  for (int i = 0; i < hdr.rows * 2; i++) {
+    int size;
+    if (p + sizeof size > len)
+      break;
+    memcpy(&size, data + p, sizeof size);
+    p += sizeof size;
+    if (size <= 0 || p + size > len)
+      break;
+    const uchar * cline = data + p;
+    // drop the rest of a corrupt keyframe
+    if (compressedline_check((uchar *)cline, size) != size)
+      break;
+    p += size;
+
+    bool alt = i >= hdr.rows;
+    int y = alt ? i - hdr.rows : i;
+    if (y >= term.rows)
+      continue;
+    termline * line = decompressline((uchar *)cline, null);
+    line->temporary = false;
+    resizeline(line, term.cols);
+    termlines * lines = alt ? term.other_lines : term.lines;
+    freeline(lines[y]);
+    lines[y] = line;
+  }
+
+  term_switch_screen(hdr.on_alt_screen, false);
+
+  void restore_cursor(term_cursor * curs, term_cursor * saved) {
+    *curs = *saved;
+    curs->x = max(0, min(curs->x, term.cols - 1));
+    curs->y = max(0, min(curs->y, term.rows - 1));
+  }
+  restore_cursor(&term.curs, &hdr.curs);
+  restore_cursor(&term.saved_cursors[0], &hdr.saved_cursors[0]);
+  restore_cursor(&term.saved_cursors[1], &hdr.saved_cursors[1]);
+  term_update_cs();
+
+  term.marg_bot = max(0, min(hdr.marg_bot, term.rows - 1));
+  term.marg_top = max(0, min(hdr.marg_top, term.marg_bot));
+  term.rvideo = hdr.rvideo;
+  term.cursor_on = hdr.cursor_on;
+  term.insert = hdr.insert;
+  term.newline_mode = hdr.newline_mode;
+  term.app_cursor_keys = hdr.app_cursor_keys;
+  term.app_keypad = hdr.app_keypad;
+  term.bracketed_paste = hdr.bracketed_paste;
+  term.cursor_type = hdr.cursor_type;
+  return true;
+}
+
 /*
  * Set up the terminal for a given size.
  */
@@ -854,7 +1168,7 @@ term_resize(int newrows, int newcols)
 void
 term_switch_screen(bool to_alt, bool reset)
 {
-  imglist *first, *last;
+  struct imgindex *index;
   long long int offset;
 
   if (to_alt == term.on_alt_screen)
@@ -866,15 +1180,12 @@ term_switch_screen(bool to_alt, bool reset)
   term.lines = term.other_lines;
   term.other_lines = oldlines;
 
-  /* swap image list */
-  first = term.imgs.first;
-  last = term.imgs.last;
+  /* swap image index */
+  index = term.imgs.index;
   offset = term.virtuallines;
-  term.imgs.first = term.imgs.altfirst;
-  term.imgs.last = term.imgs.altlast;
+  term.imgs.index = term.imgs.altindex;
   term.virtuallines = term.altvirtuallines;
-  term.imgs.altfirst = first;
-  term.imgs.altlast = last;
+  term.imgs.altindex = index;
   term.altvirtuallines = offset;
 
   if (to_alt && reset)
@@ -1082,6 +1393,9 @@ term_paint(void)
     term.cursor_on && !term.show_other_screen
     ? term.curs.y - term.disptop : -1;
 
+  tblink_visible = tblink2_visible = false;
+  cblink_visible = curs_y >= 0 && curs_y < term.rows;
+
   for (int i = 0; i < term.rows; i++) {
     pos scrpos;
     scrpos.y = i + term.disptop;
@@ -1147,11 +1461,13 @@ term_paint(void)
       if (term.blink_is_real && (tattr.attr & ATTR_BLINK)) {
         if (term.has_focus && term.tblinker)
           tchar = ' ';
+        tblink_visible = true;
         tattr.attr &= ~ATTR_BLINK;
       }
       if (term.blink_is_real && (tattr.attr & ATTR_BLINK2)) {
         if (term.has_focus && term.tblinker2)
           tchar = ' ';
+        tblink2_visible = true;
         tattr.attr &= ~ATTR_BLINK2;
       }
 
@@ -1589,6 +1905,13 @@ term_paint(void)
   }
 
   term.cursor_invalid = false;
+
+  // Start blinking what has become visible, or stop the timers
+  // with the next tick.
+  term_schedule_tblink();
+  term_schedule_tblink2();
+  if (!cblink_armed)
+    term_schedule_cblink();
 }
 
 void
@@ -225,6 +225,8 @@ extern void clear_cc(termline *, int col);
 
 extern uchar *compressline(termline *);
 extern termline *decompressline(uchar *, int *bytes_used);
+extern int compressedline_size(uchar *);
+extern int compressedline_check(uchar *, int limit);
 
 extern termchar *term_bidi_line(termline *, int scr_y);
 
@@ -289,37 +291,22 @@ typedef struct {
   bool utf;
 } term_cursor;
 
-typedef struct {
-  void *fp;
-  uint ref_counter;
-  uint amount;
-} tempfile_t;
-
-typedef struct {
-  tempfile_t *tempfile;
-  size_t position;
-} temp_strage_t;
-
 typedef struct imglist {
-  unsigned char *pixels;
-  void *hdc;
-  void *hbmp;
-  temp_strage_t *strage;
+  struct imgdata *data;  // shared contents
   int top;
   int left;
   int width;
   int height;
   int pixelwidth;
   int pixelheight;
-  struct imglist *next;
+  uint seq;              // placement order
 } imglist;
 
 typedef struct {
   void *parser_state;
-  imglist *first;
-  imglist *last;
-  imglist *altfirst;
-  imglist *altlast;
+  void *file_state;           // OSC 1337 inline image being received
+  struct imgindex *index;     // images of current screen
+  struct imgindex *altindex;  // images of the other screen
 } termimgs;
 
 struct term {
@@ -413,6 +400,7 @@ struct term {
   uint cmd_buf_cap;
   uint cmd_len;
   int dcs_cmd;
+  struct clipstream *clip_stream;  // OSC 52 contents being decoded
 
   uchar *tabs;
 
@@ -491,6 +479,10 @@ extern void term_resize(int, int);
 extern void term_scroll(int, int);
 extern void term_reset(void);
 extern void term_clear_scrollback(void);
+extern void term_save_session(void);
+extern void term_restore_session(void);
+extern uchar * term_save_keyframe(uint * len);
+extern bool term_restore_keyframe(const uchar *, uint len);
 extern void term_mouse_click(mouse_button, mod_keys, pos, int count);
 extern void term_mouse_release(mouse_button, mod_keys, pos);
 extern void term_mouse_move(mod_keys, pos);
@@ -509,6 +501,7 @@ extern void term_flip_screen(void);
 extern void term_reset_screen(void);
 extern void term_write(const char *, uint len);
 extern void term_flush(void);
+extern uint term_input_room(void);
 extern void term_set_focus(bool has_focus, bool may_report);
 extern int  term_cursor_type(void);
 extern bool term_cursor_blinks(void);
@@ -6,9 +6,13 @@
 #include "termpriv.h"
 
 #include "win.h"
+#include "winpriv.h"  // win_prefix_title, win_unprefix_title
 #include "child.h"
 #include "charset.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+
 /*
  * Helper routine for term_copy(): growing buffer.
  */
@@ -17,7 +21,7 @@ typedef struct {
   int bufpos;   /* amount of actual data */
   wchar *textbuf;       /* buffer for copied text */
   wchar *textptr;       /* = textbuf + bufpos (current insertion point) */
-  uint *attrbuf; /* buffer for copied attributes */
+  uint *attrbuf; /* buffer for copied attributes, or null if not needed */
   uint *attrptr; /* = attrbuf + bufpos */
 } clip_workbuf;
 
@@ -25,30 +29,42 @@ static void
 clip_addchar(clip_workbuf * b, wchar chr, int attr)
 {
   if (b->bufpos >= b->buflen) {
-    b->buflen += 128;
+   /* Grow geometrically to keep copying large selections linear. */
+    b->buflen = b->buflen * 3 / 2 + 128;
     b->textbuf = renewn(b->textbuf, b->buflen);
     b->textptr = b->textbuf + b->bufpos;
-    b->attrbuf = renewn(b->attrbuf, b->buflen);
-    b->attrptr = b->attrbuf + b->bufpos;
+    if (b->attrbuf) {
+      b->attrbuf = renewn(b->attrbuf, b->buflen);
+      b->attrptr = b->attrbuf + b->bufpos;
+    }
   }
   *b->textptr++ = chr;
-  *b->attrptr++ = attr;
+  if (b->attrbuf)
+    *b->attrptr++ = attr;
   b->bufpos++;
 }
 
+/* Limit for the initial buffer size estimated from the selection size. */
+#define CLIP_PRESIZE_MAX (1 << 20)
+
 static void
-get_selection(clip_workbuf *buf, pos start, pos end, bool rect)
+clip_init(clip_workbuf * b, long len, bool attrs)
 {
-//  pos start = term.sel_start, end = term.sel_end; bool rect = term.sel_rect;
+  b->buflen = max(128, min(len, CLIP_PRESIZE_MAX));
+  b->bufpos = 0;
+  b->textptr = b->textbuf = newn(wchar, b->buflen);
+  b->attrptr = b->attrbuf = attrs ? newn(uint, b->buflen) : 0;
+}
 
+/*
+ * Extract the text (and attributes) from start to end into the buffer.
+ */
+static void
+get_lines(clip_workbuf *buf, pos start, pos end, bool rect)
+{
   int old_top_x;
   int attr;
 
-  buf->buflen = 5120;
-  buf->bufpos = 0;
-  buf->textptr = buf->textbuf = newn(wchar, buf->buflen);
-  buf->attrptr = buf->attrbuf = newn(uint, buf->buflen);
-
   old_top_x = start.x;    /* needed for rect==1 */
 
   while (poslt(start, end)) {
@@ -137,6 +153,92 @@ get_selection(clip_workbuf *buf, pos start, pos end, bool rect)
 
     release_line(line);
   }
+}
+
+/*
+ * Large ranges of lines are extracted in parallel, in chunks of lines
+ * that are decompressed and extracted independently, and then joined.
+ * Chunk seams are at line boundaries, where line wrapping is handled
+ * the same as within a chunk.
+ */
+#define PARALLEL_MIN_LINES 4096
+#define PARALLEL_MAX_THREADS 8
+
+typedef struct {
+  pos start, end;
+  bool attrs;
+  clip_workbuf buf;
+} clip_chunk;
+
+static void *
+get_chunk(void * arg)
+{
+  clip_chunk * c = arg;
+  clip_init(&c->buf, (long)(c->end.y - c->start.y + 1) * (term.cols + 2),
+            c->attrs);
+  get_lines(&c->buf, c->start, c->end, false);
+  return 0;
+}
+
+static void
+get_selection(clip_workbuf *buf, pos start, pos end, bool rect, bool attrs)
+{
+//  pos start = term.sel_start, end = term.sel_end; bool rect = term.sel_rect;
+
+  int lines = end.y - start.y + 1;
+  int nthreads = min(sysconf(_SC_NPROCESSORS_ONLN), PARALLEL_MAX_THREADS);
+
+  if (rect || lines < PARALLEL_MIN_LINES || nthreads < 2) {
+   /* Size the buffer for the selection, plus line ends and terminator. */
+    clip_init(buf, (long)lines * (term.cols + 2) + 1, attrs);
+    get_lines(buf, start, end, rect);
+    clip_addchar(buf, 0, 0);
+    return;
+  }
+
+  clip_chunk chunks[nthreads];
+  pthread_t threads[nthreads];
+  bool started[nthreads];
+  int y = start.y;
+  for (int i = 0; i < nthreads; i++) {
+    int ynext = start.y + (long)lines * (i + 1) / nthreads;
+    chunks[i].start = i ? (pos){y, 0} : start;
+    chunks[i].end = i < nthreads - 1 ? (pos){ynext, 0} : end;
+    chunks[i].attrs = attrs;
+    y = ynext;
+  }
+
+ /* Chunk 0 is extracted here while the worker threads do the others. */
+  for (int i = 1; i < nthreads; i++)
+    started[i] = !pthread_create(&threads[i], 0, get_chunk, &chunks[i]);
+  get_chunk(&chunks[0]);
+  for (int i = 1; i < nthreads; i++) {
+    if (started[i])
+      pthread_join(threads[i], 0);
+    else
+      get_chunk(&chunks[i]);
+  }
+
+ /* Concatenate the chunks. */
+  long len = 1;
+  for (int i = 0; i < nthreads; i++)
+    len += chunks[i].buf.bufpos;
+  buf->buflen = len;
+  buf->bufpos = 0;
+  buf->textptr = buf->textbuf = newn(wchar, len);
+  buf->attrptr = buf->attrbuf = attrs ? newn(uint, len) : 0;
+  for (int i = 0; i < nthreads; i++) {
+    clip_workbuf * c = &chunks[i].buf;
+    memcpy(buf->textptr, c->textbuf, c->bufpos * sizeof(wchar));
+    buf->textptr += c->bufpos;
+    if (attrs) {
+      memcpy(buf->attrptr, c->attrbuf, c->bufpos * sizeof(uint));
+      buf->attrptr += c->bufpos;
+    }
+    buf->bufpos += c->bufpos;
+    free(c->textbuf);
+    free(c->attrbuf);
+  }
   clip_addchar(buf, 0, 0);
 }
 
@@ -147,7 +249,7 @@ term_copy(void)
     return;
 
   clip_workbuf buf;
-  get_selection(&buf, term.sel_start, term.sel_end, term.sel_rect);
+  get_selection(&buf, term.sel_start, term.sel_end, term.sel_rect, true);
 
  /* Finally, transfer all that to the clipboard. */
   win_copy(buf.textbuf, buf.attrbuf, buf.bufpos);
@@ -161,8 +263,7 @@ term_open(void)
   if (!term.selected)
     return;
   clip_workbuf buf;
-  get_selection(&buf, term.sel_start, term.sel_end, term.sel_rect);
-  free(buf.attrbuf);
+  get_selection(&buf, term.sel_start, term.sel_end, term.sel_rect, false);
 
   // Don't bother opening if it's all whitespace.
   wchar *p = buf.textbuf;
@@ -197,6 +298,34 @@ term_paste(wchar *data, uint len)
   term_send_paste();
 }
 
+/*
+ * Pastes are sent in chunks, encoded as they go, as long as the child
+ * keeps up with its input; child_proc calls term_send_paste again when
+ * the pty can take more. Progress of large pastes is shown in the title.
+ */
+#define PASTE_CHUNK 4096              // characters sent at once
+#define PASTE_CHUNKS 16               // chunks per call
+#define PASTE_PENDING_MAX (64 * 1024) // bytes of input queued for the child
+#define PASTE_PROGRESS_MIN (256 * 1024)
+
+static wchar paste_prefix[32];
+static int paste_percent = -1;
+
+static void
+show_paste_progress(int percent)
+{
+  if (percent == paste_percent)
+    return;
+  if (paste_percent >= 0)
+    win_unprefix_title(paste_prefix);
+  paste_percent = percent;
+  if (percent >= 0) {
+    swprintf(paste_prefix, lengthof(paste_prefix), W("[%ls %d%%] "),
+             _W("Pasting"), percent);
+    win_prefix_title(paste_prefix);
+  }
+}
+
 void
 term_cancel_paste(void)
 {
@@ -205,19 +334,31 @@ term_cancel_paste(void)
     term.paste_buffer = 0;
     if (term.bracketed_paste)
       child_write("\e[201~", 6);
+    show_paste_progress(-1);
   }
 }
 
 void
 term_send_paste(void)
 {
-  int i = term.paste_pos;
-  while (i < term.paste_len && term.paste_buffer[i++] != '\r');
-  child_sendw(term.paste_buffer + term.paste_pos, i - term.paste_pos);
-  if (i < term.paste_len)
+  for (int n = 0; n < PASTE_CHUNKS; n++) {
+    if (term.paste_pos >= term.paste_len) {
+      term_cancel_paste();
+      return;
+    }
+    if (child_write_pending() >= PASTE_PENDING_MAX)
+      break;
+
+    int i = min(term.paste_pos + PASTE_CHUNK, term.paste_len);
+    // don't split a surrogate pair
+    if (i < term.paste_len && (term.paste_buffer[i - 1] & 0xFC00) == 0xD800)
+      i--;
+    child_sendw(term.paste_buffer + term.paste_pos, i - term.paste_pos);
     term.paste_pos = i;
-  else
-    term_cancel_paste();
+  }
+
+  if (term.paste_len >= PASTE_PROGRESS_MIN)
+    show_paste_progress((long long)term.paste_pos * 100 / term.paste_len);
 }
 
 void
@@ -309,21 +450,89 @@ term_get_text(bool all, bool screen, bool command)
   }
 
   clip_workbuf buf;
-  get_selection(&buf, start, end, rect);
-  wchar * tbuf = buf.textbuf;
-  free(buf.attrbuf);
-  return tbuf;
+  get_selection(&buf, start, end, rect, false);
+  return buf.textbuf;
+}
+
+/*
+ * Export the complete terminal contents, including scrollback, to a file.
+ * Lines are extracted and converted in chunks, so memory use does not
+ * depend on the size of the scrollback buffer.
+ */
+#define EXPORT_CHUNK_LINES 256
+
+static bool
+term_export_text(FILE * f)
+{
+  int top = -sblines();
+  int bot = term_last_nonempty_line();
+  bool ok = true;
+
+  for (int y = top; ok && y <= bot; y += EXPORT_CHUNK_LINES) {
+    pos start = (pos){y, 0};
+    pos end = y + EXPORT_CHUNK_LINES > bot
+              ? (pos){bot, term.cols}
+              : (pos){y + EXPORT_CHUNK_LINES, 0};
+    clip_workbuf buf;
+    get_selection(&buf, start, end, false, false);
+    char * text = cs__wcstombs(buf.textbuf);
+    free(buf.textbuf);
+    ok = fputs(text, f) >= 0;
+    free(text);
+  }
+  return ok;
+}
+
+/*
+ * Set MINTTY_BUFFER from the end of the exported terminal contents,
+ * starting with a complete line if they exceed BUFFER_ENV_MAX,
+ * to stay within environment size limits.
+ */
+#define BUFFER_ENV_MAX (1024 * 1024)
+
+static void
+setenv_buffer(FILE * bf)
+{
+  long size = max(0, ftell(bf));
+  long start = max(0, size - BUFFER_ENV_MAX);
+  char * buf = newn(char, size - start + 1);
+  uint len = 0;
+  if (fseek(bf, start, SEEK_SET) == 0)
+    len = fread(buf, 1, size - start, bf);
+  buf[len] = 0;
+  char * text = buf;
+  if (start) {
+    char * nl = strchr(buf, '\n');
+    text = nl ? nl + 1 : buf + len;
+  }
+  setenv("MINTTY_BUFFER", text, true);
+  free(buf);
 }
 
 void
 term_cmd(char * cmdpat)
 {
-  // provide scrollback buffer
-  wchar * wsel = term_get_text(true, false, false);
-  char * sel = cs__wcstombs(wsel);
-  free(wsel);
-  setenv("MINTTY_BUFFER", sel, true);
-  free(sel);
+  // provide scrollback buffer in a file, and its end in the environment
+  char * buffile = asform("%s/.mintty-buffer.XXXXXX", tmpdir());
+  int buffd = mkstemp(buffile);
+  FILE * bf = buffd >= 0 ? fdopen(buffd, "w+") : 0;
+  if (bf) {
+    if (term_export_text(bf) && fflush(bf) == 0)
+      setenv("MINTTY_BUFFER_FILE", buffile, true);
+    setenv_buffer(bf);
+    fclose(bf);
+  }
+  wchar * wsel;
+  char * sel;
+  if (!bf) {
+    if (buffd >= 0)
+      close(buffd);
+    wsel = term_get_text(true, false, false);
+    sel = cs__wcstombs(wsel);
+    free(wsel);
+    setenv("MINTTY_BUFFER", sel, true);
+    free(sel);
+  }
   // provide current selection
   wsel = term_get_text(false, false, false);
   sel = cs__wcstombs(wsel);
@@ -370,6 +579,7 @@ term_cmd(char * cmdpat)
   unsetenv("MINTTY_SCREEN");
   unsetenv("MINTTY_SELECT");
   unsetenv("MINTTY_BUFFER");
+  unsetenv("MINTTY_BUFFER_FILE");
   unsetenv("MINTTY_CWD");
   unsetenv("MINTTY_PROG");
   if (cmdf) {
@@ -383,5 +593,8 @@ term_cmd(char * cmdpat)
     if (term.bracketed_paste)
       child_write("\e[201~", 6);
   }
+  if (buffd >= 0)
+    unlink(buffile);
+  free(buffile);
 }
 
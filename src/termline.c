@@ -5,6 +5,7 @@
 
 #include "termpriv.h"
 #include "win.h"  // cfg.bidi
+#include "charset.h"  // is_high_surrogate, is_low_surrogate
 
 
 termline *
@@ -54,12 +55,34 @@ add(struct buf *b, uchar c)
   b->data[b->len++] = c;
 }
 
+/*
+ * Reading stops at the buffer size; beyond it, zeros are returned,
+ * and the length runs past the size.
+ */
 static int
 get(struct buf *b)
 {
+  if (b->len >= b->size) {
+    b->len++;
+    return 0;
+  }
   return b->data[b->len++];
 }
 
+/*
+ * Limit the number of combining characters per character cell
+ * (a non-BMP combining character takes two, as a surrogate pair),
+ * so that floods of combining marks ("Zalgo" text) can neither make
+ * lines grow without bound nor make add_cc and clear_cc walk ever
+ * longer cc lists. Excess combining characters are dropped.
+ */
+#define CC_MAX 32
+/*
+ * Limit the allocated size of a line so that the relative cc_next
+ * offsets (short) and the size field stay in range.
+ */
+#define LINE_SIZE_MAX 0x7FFF
+
 /*
  * Add a combining character to a character cell.
  */
@@ -69,11 +92,36 @@ add_cc(termline *line, int col, wchar chr, cattr attr)
   assert(col >= 0 && col < line->cols);
 
  /*
-  * Start by extending the cols array if the free list is empty.
+  * Find the last cc currently in this cell, counting the list.
+  */
+  int last = col, ccs = 0;
+  while (line->chars[last].cc_next) {
+    last += line->chars[last].cc_next;
+    ccs++;
+  }
+
+ /*
+  * Enforce the per-cell limit. A low surrogate is only kept to complete
+  * a pair, so a high surrogate must leave room for it.
+  */
+  if (is_low_surrogate(chr)) {
+    if (!is_high_surrogate(line->chars[last].chr))
+      return;
+  }
+  else if (ccs + (is_high_surrogate(chr) ? 2 : 1) > CC_MAX)
+    return;
+
+ /*
+  * Extend the cols array if the free list is empty.
   */
   if (!line->cc_free) {
     int n = line->size;
-    line->size += 16 + (line->size - line->cols) / 2;
+    int size = line->size + 16 + (line->size - line->cols) / 2;
+    if (size > LINE_SIZE_MAX)
+      size = LINE_SIZE_MAX;
+    if (size < n + 2)
+      return;  // line is full
+    line->size = size;
     line->chars = renewn(line->chars, line->size);
     line->cc_free = n;
     do
@@ -83,14 +131,8 @@ add_cc(termline *line, int col, wchar chr, cattr attr)
   }
 
  /*
-  * Now walk the cc list of the cell in question.
-  */
-  while (line->chars[col].cc_next)
-    col += line->chars[col].cc_next;
-
- /*
-  * `col' now points at the last cc currently in this cell; so
-  * we simply add another one.
+  * `last' points at the last cc currently in this cell (or the cell
+  * itself); so we simply add another one.
   */
   int newcc = line->cc_free;
   if (line->chars[newcc].cc_next)
@@ -100,7 +142,7 @@ add_cc(termline *line, int col, wchar chr, cattr attr)
   line->chars[newcc].cc_next = 0;
   line->chars[newcc].chr = chr;
   line->chars[newcc].attr = attr;
-  line->chars[col].cc_next = newcc - col;
+  line->chars[last].cc_next = newcc - last;
 }
 
 /*
@@ -600,6 +642,7 @@ decompressline(uchar *data, int *bytes_used)
 
   b->data = data;
   b->len = 0;
+  b->size = INT_MAX;
 
  /*
   * First read in the column count.
@@ -656,6 +699,110 @@ decompressline(uchar *data, int *bytes_used)
   return line;
 }
 
+/*
+ * Determine the size of a compressed line without decompressing it,
+ * by skipping over the literals of its RLE streams.
+ */
+static void
+skipliteral_chr(struct buf *buf)
+{
+  termchar c;
+  readliteral_chr(buf, &c, 0);
+}
+
+static void
+skipliteral_attr(struct buf *buf)
+{
+  if (get(buf) & 0x80)
+    buf->len += 13;
+  else
+    buf->len += 2;
+}
+
+static void
+skipliteral_cc(struct buf *buf)
+{
+  // terminated like in readliteral_cc
+  for (;;) {
+    termchar c;
+    readliteral_chr(buf, &c, 0);
+    if (!c.chr)
+      break;
+    skipliteral_attr(buf);
+  }
+}
+
+static bool
+skiprle(struct buf *b, int cols, void (*skipliteral) (struct buf *b))
+{
+  int n = 0;
+
+  while (n < cols && b->len <= b->size) {
+    int hdr = get(b);
+
+    if (hdr >= 0x80) {
+      skipliteral(b);
+      n += hdr + 2 - 0x80;
+    }
+    else {
+      int count = hdr + 1;
+      while (count--)
+        skipliteral(b);
+      n += hdr + 1;
+    }
+  }
+
+  return n == cols;
+}
+
+/*
+ * Check a compressed line read from a file: return its size,
+ * or -1 if it is malformed or extends beyond the given limit.
+ */
+int
+compressedline_check(uchar *data, int limit)
+{
+  int ncols, byte, shift;
+  struct buf buffer, *b = &buffer;
+
+  b->data = data;
+  b->len = 0;
+  b->size = limit;
+
+  ncols = shift = 0;
+  do {
+    byte = get(b);
+    ncols |= (byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80 && shift < 28);
+  if (byte & 0x80)
+    return -1;
+
+  shift = 0;
+  do {
+    byte = get(b);
+    shift += 7;
+  } while (byte & 0x80 && shift < 28);
+  if (byte & 0x80)
+    return -1;
+
+  if (!skiprle(b, ncols, skipliteral_chr)
+      || !skiprle(b, ncols, skipliteral_attr)
+      || !skiprle(b, ncols, skipliteral_cc)
+      || b->len > b->size)
+    return -1;
+
+  return b->len;
+}
+
+int
+compressedline_size(uchar *data)
+{
+  int size = compressedline_check(data, INT_MAX);
+  assert(size >= 0);
+  return size;
+}
+
 /*
  * Clear a line, throwing away any combining characters.
  */
@@ -13,11 +13,14 @@
 #include "sixel.h"
 #include "winimg.h"
 #include "base64.h"
+#include "imgfile.h"
+#include "latency.h"
 
 #include <sys/termios.h>
 
 #define TERM_CMD_BUF_INC_STEP 128
 #define TERM_CMD_BUF_MAX_SIZE (1024 * 1024)
+#define TERM_CLIP_MAX_SIZE (64 * 1024 * 1024)
 
 /* This combines two characters into one value, for the purpose of pairing
  * any modifier byte and the final byte in escape sequences.
@@ -1073,6 +1076,48 @@ do_csi(uchar c)
   }
 }
 
+/*
+ * Fill the cells covered by a new image at the cursor position,
+ * scrolling as needed.
+ */
+static void
+write_image_cells(imglist *img)
+{
+  int x0 = term.curs.x;
+
+  for (int i = 0; i < img->height; ++i) {
+    term.curs.x = x0;
+    for (int x = x0; x < x0 + img->width && x < term.cols; ++x)
+      write_char(SIXELCH, 1);
+    if (i == img->height - 1) {  // in the last line
+      if (!term.sixel_scrolls_right) {
+        write_linefeed();
+        term.curs.x = term.sixel_scrolls_left ? 0: x0;
+      }
+    } else {
+      write_linefeed();
+    }
+  }
+}
+
+/*
+ * Feed a run of DECSIXEL data straight from the input stream to the parser;
+ * the parser keeps its own state across runs, so no buffering is needed.
+ */
+static void
+do_sixel_data(const char *s, uint len)
+{
+  sixel_state_t *st = (sixel_state_t *)term.imgs.parser_state;
+
+  if (!st)
+    return;
+  if (sixel_parser_parse(st, (unsigned char *)s, len) < 0) {
+    sixel_parser_destroy(st);
+    term.imgs.parser_state = NULL;
+    term.state = DCS_IGNORE;
+  }
+}
+
 static void
 do_dcs(void)
 {
@@ -1080,9 +1125,7 @@ do_dcs(void)
   // No DECUDK (User-Defined Keys) or xterm termcap/terminfo data.
 
   char *s = term.cmd_buf;
-  unsigned char *pixels;
-  int i;
-  imglist *cur, *img;
+  imglist *img;
   colour bg, fg;
   cattr attr = term.curs.attr;
   int status = (-1);
@@ -1099,42 +1142,20 @@ do_dcs(void)
 
     switch (term.state) {
     when DCS_PASSTHROUGH:
-      if (!st)
-        return;
-      status = sixel_parser_parse(st, (unsigned char *)s, term.cmd_len);
-      if (status < 0) {
-        sixel_parser_deinit(st);
-        free(term.imgs.parser_state);
-        term.imgs.parser_state = NULL;
-        term.state = DCS_IGNORE;
-        return;
-      }
+      // sixel data is passed to the parser by term_write (do_sixel_data)
+      return;
 
     when DCS_ESCAPE:
-      if (!st)
+      if (!st || !st->image.tiles)
         return;
-      status = sixel_parser_parse(st, (unsigned char *)s, term.cmd_len);
-      if (status < 0) {
-        sixel_parser_deinit(st);
-        free(term.imgs.parser_state);
-        term.imgs.parser_state = NULL;
-        return;
-      }
 
-      pixels = (unsigned char *)malloc(st->image.width * st->image.height * 4);
-      if (!pixels)
-        return;
-
-      status = sixel_parser_finalize(st, pixels);
+      status = sixel_parser_finalize(st);
       if (status < 0) {
-        sixel_parser_deinit(st);
-        free(term.imgs.parser_state);
+        sixel_parser_destroy(st);
         term.imgs.parser_state = NULL;
         return;
       }
 
-      sixel_parser_deinit(st);
-
       left = term.curs.x;
       top = term.virtuallines + (term.sixel_display ? 0: term.curs.y);
       width = st->image.width / st->grid_width;
@@ -1142,9 +1163,11 @@ do_dcs(void)
       pixelwidth = st->image.width;
       pixelheight = st->image.height;
 
-      if (!winimg_new(&img, pixels, left, top, width, height, pixelwidth, pixelheight) != 0) {
-        sixel_parser_deinit(st);
-        free(term.imgs.parser_state);
+      bool ok = winimg_new(&img, (img_row_fn)sixel_parser_get_row, st,
+                           left, top, width, height, pixelwidth, pixelheight);
+      sixel_parser_deinit(st);
+      if (!ok) {
+        sixel_parser_destroy(st);
         term.imgs.parser_state = NULL;
         return;
       }
@@ -1165,53 +1188,12 @@ do_dcs(void)
         term.curs.y = y0;
         term.curs.x = x0;
       } else {  // sixel scrolling mode
-        for (i = 0; i < img->height; ++i) {
-          term.curs.x = x0;
-          for (x = x0; x < x0 + img->width && x < term.cols; ++x)
-            write_char(SIXELCH, 1);
-          if (i == img->height - 1) {  // in the last line
-            if (!term.sixel_scrolls_right) {
-              write_linefeed();
-              term.curs.x = term.sixel_scrolls_left ? 0: x0;
-            }
-          } else {
-            write_linefeed();
-          }
-        }
+        write_image_cells(img);
       }
 
       term.curs.attr.attr = attr0;
 
-      if (term.imgs.first == NULL) {
-        term.imgs.first = term.imgs.last = img;
-      } else {
-        for (cur = term.imgs.first; cur; cur = cur->next) {
-          if (cur->pixelwidth == cur->width * st->grid_width &&
-              cur->pixelheight == cur->height * st->grid_height) {
-            if (img->top == cur->top && img->left == cur->left &&
-                img->width == cur->width &&
-                img->height == cur->height) {
-                memcpy(cur->pixels, img->pixels, img->pixelwidth * img->pixelheight * 4);
-                winimg_destroy(img);
-                return;
-            }
-            if (img->top >= cur->top && img->left >= cur->left &&
-                img->left + img->width <= cur->left + cur->width &&
-                img->top + img->height <= cur->top + cur->height) {
-                for (y = 0; y < img->pixelheight; ++y)
-                  memcpy(cur->pixels +
-                           ((img->top - cur->top) * st->grid_height + y) * cur->pixelwidth * 4 +
-                           (img->left - cur->left) * st->grid_width * 4,
-                         img->pixels + y * img->pixelwidth * 4,
-                         img->pixelwidth * 4);
-                winimg_destroy(img);
-                return;
-            }
-          }
-        }
-        term.imgs.last->next = img;
-        term.imgs.last = img;
-      }
+      winimgs_add(img, st->grid_width, st->grid_height);
 
     otherwise:
       /* parser status initialization */
@@ -1346,42 +1328,128 @@ do_colour_osc(bool has_index_arg, uint i, bool reset)
 /*
  * OSC52: \e]52;[cp0-6];?|base64-string\07"
  * Only system clipboard is supported now.
+ * The contents are decoded as they arrive (see term_write),
+ * so they are not limited by the command buffer size.
  */
-static void do_clipboard(void)
+struct clipstream {
+  base64_stream b64;
+  char *data;
+  uint len, cap;
+  bool failed;
+};
+
+static void
+start_clipboard(void)
 {
-  char *s = term.cmd_buf;
-  char *output;
-  int len;
-  int ret;
+  if (cfg.allow_set_selection)
+    term.clip_stream = calloc(1, sizeof(struct clipstream));
+  if (term.clip_stream)
+    base64_stream_init(&term.clip_stream->b64);
+  else
+    term.state = IGNORE_STRING;
+}
 
-  if (!cfg.allow_set_selection) {
-    return;
+static void
+stop_clipboard(void)
+{
+  if (term.clip_stream) {
+    free(term.clip_stream->data);
+    free(term.clip_stream);
+    term.clip_stream = NULL;
   }
+}
 
-  while (*s != ';' && *s != '\0') {
-    s += 1;
-  }
-  if (*s != ';') {
-    return;
-  }
-  s += 1;
-  if (*s == '?') {
-    /* Reading from clipboard is unsupported */
+static void
+clipboard_write(const char *s, uint len)
+{
+  struct clipstream *cs = term.clip_stream;
+
+  if (cs->failed)
     return;
+
+  // room for the decoded data and a terminating null byte
+  size_t need = cs->len + (size_t)BASE64_STREAM_OLEN(len) + 1;
+  if (need > cs->cap) {
+    char *data = NULL;
+    if (need <= TERM_CLIP_MAX_SIZE) {
+      need = max(need, min((size_t)cs->cap * 2, TERM_CLIP_MAX_SIZE));
+      data = realloc(cs->data, need);
+    }
+    if (!data) {
+      cs->failed = true;
+      return;
+    }
+    cs->data = data;
+    cs->cap = need;
   }
-  len = strlen(s);
 
-  output = malloc(len + 1);
-  if (output == NULL) {
-    return;
+  // A query ('?', unsupported) or invalid data makes this fail.
+  int n = base64_decode_stream(&cs->b64, s, len, cs->data + cs->len);
+  if (n < 0)
+    cs->failed = true;
+  else
+    cs->len += n;
+}
+
+static void
+do_clipboard(void)
+{
+  struct clipstream *cs = term.clip_stream;
+
+  if (cs && !cs->failed && cs->data) {
+    // an incomplete last group is ignored
+    int n = base64_stream_finish(&cs->b64, cs->data + cs->len);
+    if (n > 0)
+      cs->len += n;
+    if (cs->len) {
+      cs->data[cs->len] = '\0';
+      win_copy_text(cs->data);
+    }
   }
+  stop_clipboard();
+}
+
+/*
+ * OSC 1337 inline images (from iTerm2):
+ * \e]1337;File=[arguments]:base64-file\a
+ * The file is decoded from base64 as it arrives (see term_write).
+ */
+static void
+start_image_file(void)
+{
+  colour bg = win_get_colour(term.rvideo ? FG_COLOUR_I: BG_COLOUR_I);
+
+  term.cmd_buf[term.cmd_len] = 0;
+  term.imgs.file_state = imgfile_start(term.cmd_buf, bg);
+  if (!term.imgs.file_state)
+    term.state = IGNORE_STRING;
+}
+
+static void
+stop_image_file(void)
+{
+  imgfile_destroy(term.imgs.file_state);
+  term.imgs.file_state = NULL;
+}
 
-  ret = base64_decode_clip(s, len, output, len);
-  if (ret > 0) {
-    output[ret] = '\0';
-    win_copy_text(output);
+static void
+do_image_file(void)
+{
+  imgfile_state *st = term.imgs.file_state;
+  imglist *img;
+
+  if (!st)
+    return;
+  if (imgfile_finish(st) &&
+      winimg_new(&img, (img_row_fn)imgfile_get_row, st,
+                 term.curs.x, term.virtuallines + term.curs.y,
+                 st->width, st->height, st->pixelwidth, st->pixelheight)) {
+    int attr0 = term.curs.attr.attr;
+    write_image_cells(img);
+    term.curs.attr.attr = attr0;
+    winimgs_add(img, st->grid_width, st->grid_height);
   }
-  free(output);
+  stop_image_file();
 }
 
 /*
@@ -1422,6 +1490,12 @@ do_cmd(void)
         cs_set_locale(s);
     when 7721:  // Copy window title to clipboard.
         win_copy_title();
+    when 7775:  // Report latency statistics.
+      if (!strcmp(s, "?")) {
+        char * rep = latency_report(true);
+        child_printf("\e]7775;%s\e\\", rep ?: "");
+        free(rep);
+      }
     when 7770:  // Change font size.
       if (!strcmp(s, "?"))
         child_printf("\e]7770;%u\e\\", win_get_font_size());
@@ -1478,6 +1552,7 @@ do_cmd(void)
         term.wide_extra = true;
     }
     when 52: do_clipboard();
+    when 1337: do_image_file();
   }
 }
 
@@ -1494,34 +1569,9 @@ term_print_finish(void)
   }
 }
 
-/* Empty the input buffer */
-void
-term_flush(void)
-{
-  term_write(term.inbuf, term.inbuf_pos);
-  free(term.inbuf);
-  term.inbuf = 0;
-  term.inbuf_pos = 0;
-  term.inbuf_size = 0;
-}
-
-void
-term_write(const char *buf, uint len)
+static void
+write_output(const char *buf, uint len)
 {
- /*
-  * During drag-selects, we do not process terminal input,
-  * because the user will want the screen to hold still to be selected.
-  */
-  if (term_selecting()) {
-    if (term.inbuf_pos + len > term.inbuf_size) {
-      term.inbuf_size = max(term.inbuf_pos, term.inbuf_size * 4 + 4096);
-      term.inbuf = renewn(term.inbuf, term.inbuf_size);
-    }
-    memcpy(term.inbuf + term.inbuf_pos, buf, len);
-    term.inbuf_pos += len;
-    return;
-  }
-
   // Reset cursor blinking.
   term.cblinker = 1;
   term_schedule_cblink();
@@ -1744,6 +1794,9 @@ term_write(const char *buf, uint len)
         }
       when OSC_START:
         term.cmd_len = 0;
+        stop_clipboard();
+        if (term.imgs.file_state)
+          stop_image_file();
         switch (c) {
           when 'P':  /* Linux palette sequence */
             term.state = OSC_PALETTE;
@@ -1805,6 +1858,8 @@ term_write(const char *buf, uint len)
       when CMD_STRING:
         switch (c) {
           when '\n' or '\r':
+            stop_clipboard();
+            stop_image_file();
             term.state = NORMAL;
           when '\a':
             do_cmd();
@@ -1812,7 +1867,25 @@ term_write(const char *buf, uint len)
           when '\e':
             term.state = CMD_ESCAPE;
           otherwise:
-            term_push_cmd(c);
+            if (term.clip_stream || term.imgs.file_state) {
+              // Pass the whole run of base64 data to the decoder
+              uint end = pos;
+              if (!term.printing)
+                while (end < len && (uchar)buf[end] >= ' ')
+                  end++;
+              if (term.clip_stream)
+                clipboard_write(buf + pos - 1, end - pos + 1);
+              else
+                imgfile_write(term.imgs.file_state, buf + pos - 1, end - pos + 1);
+              pos = end;
+            }
+            else if (c == ';' && term.cmd_num == 52)
+              start_clipboard();
+            else if (c == ':' && term.cmd_num == 1337 &&
+                     term.cmd_len >= 5 && !strncmp(term.cmd_buf, "File=", 5))
+              start_image_file();
+            else
+              term_push_cmd(c);
         }
       when IGNORE_STRING:
         switch (c) {
@@ -1889,7 +1962,18 @@ term_write(const char *buf, uint len)
             term.state = DCS_ESCAPE;
             term.esc_mod = 0;
           otherwise:
-            if (!term_push_cmd(c)) {
+            if (term.dcs_cmd == 'q' && term.printing) {
+              // Each byte must also pass the printer, so feed them singly
+              do_sixel_data((char *)&c, 1);
+            }
+            else if (term.dcs_cmd == 'q') {
+              // Pass the whole run up to the next ESC to the sixel parser
+              const char *esc = memchr(buf + pos, '\e', len - pos);
+              uint end = esc ? (uint)(esc - buf) : len;
+              do_sixel_data(buf + pos - 1, end - pos + 1);
+              pos = end;
+            }
+            else if (!term_push_cmd(c)) {
               do_dcs();
               term.cmd_buf[0] = c;
               term.cmd_len = 1;
@@ -1914,6 +1998,7 @@ term_write(const char *buf, uint len)
           term.state = NORMAL;
         } else {
           term.state = ESCAPE;
+          sixel_parser_destroy(term.imgs.parser_state);
           term.imgs.parser_state = NULL;
           do_esc(c);
         }
@@ -1933,3 +2018,60 @@ term_write(const char *buf, uint len)
     term.printbuf_pos = 0;
   }
 }
+
+/* Empty the input buffer */
+void
+term_flush(void)
+{
+  char *buf = term.inbuf;
+  uint len = term.inbuf_pos;
+  term.inbuf = 0;
+  term.inbuf_pos = 0;
+  term.inbuf_size = 0;
+  write_output(buf, len);
+  free(buf);
+}
+
+static uint
+inbuf_limit(void)
+{
+  return cfg.input_buffer * 1024;
+}
+
+/*
+ * How much output can be taken without exceeding the input buffer limit.
+ * While this is 0, the pty is not read, holding back the child process.
+ */
+uint
+term_input_room(void)
+{
+  if (!term_selecting())
+    return UINT_MAX;
+  return term.inbuf_pos < inbuf_limit() ? inbuf_limit() - term.inbuf_pos : 0;
+}
+
+void
+term_write(const char *buf, uint len)
+{
+ /*
+  * During drag-selects, we do not process terminal input,
+  * because the user will want the screen to hold still to be selected.
+  * Output that does not fit into the limited input buffer anymore is
+  * processed anyway; the pty is not read meanwhile (see term_input_room),
+  * so this only happens for other output.
+  */
+  if (term_selecting() && term.inbuf_pos + len <= inbuf_limit()) {
+    if (term.inbuf_pos + len > term.inbuf_size) {
+      term.inbuf_size =
+        min(inbuf_limit(), max(term.inbuf_pos + len, term.inbuf_size * 4 + 4096));
+      term.inbuf = renewn(term.inbuf, term.inbuf_size);
+    }
+    memcpy(term.inbuf + term.inbuf_pos, buf, len);
+    term.inbuf_pos += len;
+    return;
+  }
+
+  if (term.inbuf_pos)
+    term_flush();
+  write_output(buf, len);
+}
@@ -67,6 +67,8 @@ extern void win_copy(const wchar *data, uint *attrs, int len);
 extern void win_paste(void);
 
 extern void win_set_timer(void_fn cb, uint ticks);
+extern int win_timer_wait(void);
+extern void win_run_timers(void);
 
 extern bool print_opterror(FILE * stream, string msg, bool utf8params, string p1, string p2);
 extern void win_show_about(void);
@@ -28,6 +28,7 @@
 #define IDM_SEARCH          0x00F0
 #define IDM_TOGLOG          0x01F0
 #define IDM_TOGCHARINFO     0x02F0
+#define IDM_SAVESESSION     0x0250
 #define IDM_USERCOMMAND     0x0300
 
 #endif
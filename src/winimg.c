@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <ctype.h>   /* isdigit */
 #include <string.h>  /* memcpy */
+#include <unistd.h>  /* ftruncate */
+#include <sys/mman.h>
 #include <windows.h>
 
 #include "term.h"
@@ -12,165 +14,540 @@
 #include "termpriv.h"
 #include "winimg.h"
 #include "sixel.h"
+#include "imgfile.h"
 
-// tempfile_t manipulation
+// Image memory management.
+// Images hold their encoded contents, and while displayed or recently
+// displayed also their expanded pixels, in memory. When the memory used
+// exceeds the configured ImageMemory budget, least recently painted images
+// first drop their expanded pixels, then have their encoded contents
+// evicted to a backing store, from which they are fetched when painted.
 
-static tempfile_t *tempfile_current = NULL;
-static size_t tempfile_num = 0;
-static size_t const TEMPFILE_MAX_SIZE = 1024 * 1024 * 16;  /* 16MB */
-static size_t const TEMPFILE_MAX_NUM = 16;
+// Backing store: an mmap'd temp file, with a first-fit allocator
+// over a list of free extents sorted by position.
 
-static tempfile_t *
-tempfile_new(void)
+typedef struct {
+  size_t pos;
+  size_t size;
+} extent;
+
+static FILE *store_file = NULL;
+static unsigned char *store_map = NULL;
+static size_t store_size = 0;
+static extent *store_free = NULL;
+static uint store_nfree = 0;
+static uint store_freelen = 0;
+static size_t const STORE_GROW_MIN = 1024 * 1024 * 4;  /* 4MB */
+
+static void
+store_release(size_t pos, size_t size)
 {
-  tempfile_t *tempfile;
-  FILE *fp;
+  uint i;
+
+  for (i = 0; i < store_nfree && store_free[i].pos < pos; i++)
+    ;
+
+  // coalesce with preceding and following free extent
+  if (i > 0 && store_free[i - 1].pos + store_free[i - 1].size == pos) {
+    store_free[i - 1].size += size;
+    if (i < store_nfree && pos + size == store_free[i].pos) {
+      store_free[i - 1].size += store_free[i].size;
+      store_nfree--;
+      memmove(store_free + i, store_free + i + 1,
+              (store_nfree - i) * sizeof(extent));
+    }
+    return;
+  }
+  if (i < store_nfree && pos + size == store_free[i].pos) {
+    store_free[i].pos = pos;
+    store_free[i].size += size;
+    return;
+  }
 
-  fp = tmpfile();
-  if (!fp)
-    return NULL;
+  if (store_nfree == store_freelen) {
+    store_freelen = store_freelen * 2 + 16;
+    store_free = renewn(store_free, store_freelen);
+  }
+  memmove(store_free + i + 1, store_free + i,
+          (store_nfree - i) * sizeof(extent));
+  store_free[i] = (extent){pos, size};
+  store_nfree++;
+}
 
-  tempfile = malloc(sizeof(tempfile_t));
-  if (!tempfile)
-    return NULL;
+static bool
+store_grow(size_t need)
+{
+  size_t size = store_size + max(need, max(store_size / 2, STORE_GROW_MIN));
+  size = (size + 0xFFFF) & ~(size_t)0xFFFF;
 
-  tempfile->fp = fp;
-  tempfile->ref_counter = 1;
+  if (!store_file) {
+    store_file = tmpfile();
+    if (!store_file)
+      return false;
+  }
+  if (ftruncate(fileno(store_file), size) < 0)
+    return false;
 
-  tempfile_num++;
+  unsigned char *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fileno(store_file), 0);
+  if (map == MAP_FAILED)
+    return false;
+  if (store_map)
+    munmap(store_map, store_size);
+  store_map = map;
 
-  return tempfile;
+  store_release(store_size, size - store_size);
+  store_size = size;
+  return true;
 }
 
-static void
-tempfile_destroy(tempfile_t *tempfile)
+static bool
+store_alloc(size_t size, size_t *ppos)
 {
-  if (tempfile == tempfile_current)
-    tempfile_current = NULL;
-  fclose(tempfile->fp);
-  free(tempfile);
-  tempfile_num--;
+  for (;;) {
+    for (uint i = 0; i < store_nfree; i++) {
+      if (store_free[i].size >= size) {
+        *ppos = store_free[i].pos;
+        store_free[i].pos += size;
+        store_free[i].size -= size;
+        if (!store_free[i].size) {
+          store_nfree--;
+          memmove(store_free + i, store_free + i + 1,
+                  (store_nfree - i) * sizeof(extent));
+        }
+        return true;
+      }
+    }
+    if (!store_grow(size))
+      return false;
+  }
 }
 
-static void
-tempfile_ref(tempfile_t *tempfile)
+// Paletted run-length encoding of image contents.
+// An image is kept as a palette of its distinct colours and a sequence of
+// runs, each being a palette index (1 byte for up to 256 colours, otherwise
+// 2 bytes) followed by the run length - 1 as a 7-bit varint.
+// Images with more than IMG_COLOURS_MAX colours (e.g. photos) have no
+// palette, and their runs hold the colour directly, as 4 bytes BGRA.
+// It is expanded to BGRA pixels (in a DIB section) only while displayed.
+
+#define IMG_COLOURS_MAX 0x10000
+
+// Image contents, shared by all placed images with identical contents.
+typedef struct imgdata {
+  struct imgdata *next;  // hash chain
+  uint hash;
+  int refcount;
+  uint lru;              // paint counter when last displayed
+  struct imgdata *lru_prev, *lru_next;
+  int pixelwidth;
+  int pixelheight;
+  // expanded pixels
+  unsigned char *pixels;
+  HDC hdc;
+  HBITMAP hbmp;
+  // encoded contents
+  unsigned char *rle;
+  size_t rlesize;
+  uint *palette;
+  int ncolors;
+  bool stored;           // encoded contents evicted to backing store
+  size_t storepos;
+} imgdata;
+
+// Memory used by image contents, and the images that hold expanded pixels
+// or encoded contents in memory, from least to most recently painted.
+static size_t img_memory;
+static imgdata *lru_head, *lru_tail;
+
+static size_t
+data_pixelsize(imgdata *d)
+{
+  return (size_t)d->pixelwidth * d->pixelheight * 4;
+}
+
+static size_t
+data_memsize(imgdata *d)
 {
-  tempfile->ref_counter++;
+  size_t size = d->ncolors * sizeof(uint) + sizeof(imgdata);
+  if (d->rle)
+    size += d->rlesize;
+  if (d->hdc)
+    size += data_pixelsize(d);
+  return size;
 }
 
 static void
-tempfile_deref(tempfile_t *tempfile)
+lru_unlink(imgdata *d)
 {
-  if (--tempfile->ref_counter == 0)
-    tempfile_destroy(tempfile);
+  if (!d->lru_prev && lru_head != d)
+    return;
+  *(d->lru_prev ? &d->lru_prev->lru_next : &lru_head) = d->lru_next;
+  *(d->lru_next ? &d->lru_next->lru_prev : &lru_tail) = d->lru_prev;
+  d->lru_prev = d->lru_next = NULL;
 }
 
-static size_t
-tempfile_size(tempfile_t *tempfile)
+static void
+lru_touch(imgdata *d)
 {
-  fpos_t fsize = 0;
+  lru_unlink(d);
+  d->lru_prev = lru_tail;
+  *(lru_tail ? &lru_tail->lru_next : &lru_head) = d;
+  lru_tail = d;
+}
 
-  fseek(tempfile->fp, 0L, SEEK_END);
-  fgetpos(tempfile->fp, &fsize);
+typedef struct {
+  uint *colours;
+  int ncolours;
+  int size;
+  int *slots;
+  uint mask;
+} palette_builder;
 
-  return (size_t)fsize;
+static uint
+colour_hash(uint c)
+{
+  return (c * 0x9E3779B1u) >> 12;
 }
 
-static tempfile_t *
-tempfile_get(void)
+static bool
+palette_grow(palette_builder *pb)
 {
-  size_t size;
-
-  if (!tempfile_current) {
-    tempfile_current = tempfile_new();
-    return tempfile_current;
+  uint mask = pb->mask * 2 + 1;
+  int *slots = malloc((mask + 1) * sizeof(int));
+  if (!slots)
+    return false;
+  memset(slots, -1, (mask + 1) * sizeof(int));
+  for (int n = 0; n < pb->ncolours; n++) {
+    uint i = colour_hash(pb->colours[n]) & mask;
+    while (slots[i] >= 0)
+      i = (i + 1) & mask;
+    slots[i] = n;
   }
+  free(pb->slots);
+  pb->slots = slots;
+  pb->mask = mask;
+  return true;
+}
 
-  /* get file size */
-  size = tempfile_size(tempfile_current);
-
-  /* if the file size reaches TEMPFILE_MAX_SIZE, return new temporary file */
-  if (size > TEMPFILE_MAX_SIZE) {
-    tempfile_current = tempfile_new();
-    return tempfile_current;
+// return palette index of colour, adding it if new; -1 if palette is full
+static int
+palette_lookup(palette_builder *pb, uint c)
+{
+  uint i = colour_hash(c) & pb->mask;
+  while (pb->slots[i] >= 0) {
+    if (pb->colours[pb->slots[i]] == c)
+      return pb->slots[i];
+    i = (i + 1) & pb->mask;
   }
 
-  /* increment reference counter */
-  tempfile_ref(tempfile_current);
+  if (pb->ncolours == IMG_COLOURS_MAX)
+    return -1;
+  if (pb->ncolours == pb->size) {
+    uint *colours = realloc(pb->colours, pb->size * 2 * sizeof(uint));
+    if (!colours)
+      return -1;
+    pb->colours = colours;
+    pb->size *= 2;
+  }
+  int n = pb->ncolours++;
+  pb->colours[n] = c;
+  pb->slots[i] = n;
+  if ((uint)pb->ncolours * 2 > pb->mask && !palette_grow(pb))
+    return -1;
+  return n;
+}
 
-  return tempfile_current;
+static int
+varint_size(size_t n)
+{
+  int size = 1;
+  while (n >>= 7)
+    size++;
+  return size;
 }
 
 static bool
-tempfile_write(tempfile_t *tempfile, unsigned char *p, size_t pos, size_t size)
+img_encode(imgdata *d, img_row_fn getrow, void *ctx)
 {
-  size_t nbytes;
+  palette_builder pb = {
+    .colours = malloc(256 * sizeof(uint)), .size = 256,
+    .slots = malloc(512 * sizeof(int)), .mask = 511
+  };
+  uint *buf = malloc(d->pixelwidth * sizeof(uint));
+  size_t runs = 0, varbytes = 0;
+  uchar *p = NULL;
+  bool wide = false;
+  bool direct = false;
+
+  void run(uint c, size_t n) {
+    if (!p) {
+      // collect palette and determine encoded size;
+      // fall back to direct colours if the palette overflows
+      if (!direct && palette_lookup(&pb, c) < 0)
+        direct = true;
+      runs++;
+      varbytes += varint_size(n - 1);
+      return;
+    }
 
-  fseek((FILE *)tempfile->fp, pos, SEEK_SET);
-  nbytes = fwrite(p, 1, size, tempfile->fp);
-  if (nbytes != size)
-    return false;
+    if (direct) {
+      memcpy(p, &c, sizeof c);
+      p += sizeof c;
+    }
+    else {
+      int index = palette_lookup(&pb, c);
+      *p++ = index;
+      if (wide)
+        *p++ = index >> 8;
+    }
+    size_t len = n - 1;
+    while (len >= 0x80) {
+      *p++ = len | 0x80;
+      len >>= 7;
+    }
+    *p++ = len;
+  }
+
+  // feed pixels row by row; runs continue across rows
+  void encode(void) {
+    uint c = 0;
+    size_t n = 0;
+    for (int y = 0; y < d->pixelheight; y++) {
+      const uint *row = getrow(ctx, y, buf);
+      for (int x = 0; x < d->pixelwidth; x++) {
+        if (n && row[x] == c)
+          n++;
+        else {
+          if (n)
+            run(c, n);
+          c = row[x];
+          n = 1;
+        }
+      }
+    }
+    if (n)
+      run(c, n);
+  }
+
+  if (!pb.colours || !pb.slots || !buf)
+    goto fail;
+  memset(pb.slots, -1, 512 * sizeof(int));
+
+  encode();
+
+  wide = pb.ncolours > 256;
+  d->rlesize = runs * (direct ? sizeof(uint) : wide ? 2 : 1) + varbytes;
+  d->rle = malloc(d->rlesize);
+  if (!d->rle)
+    goto fail;
+
+  p = d->rle;
+  encode();
 
+  free(buf);
+  free(pb.slots);
+  if (direct) {
+    free(pb.colours);
+    d->palette = NULL;
+    d->ncolors = 0;
+  }
+  else {
+    d->palette = realloc(pb.colours, pb.ncolours * sizeof(uint)) ?: pb.colours;
+    d->ncolors = pb.ncolours;
+  }
   return true;
+
+fail:
+  free(buf);
+  free(pb.slots);
+  free(pb.colours);
+  return false;
+}
+
+static void
+img_expand(imgdata *d, uint *pixels)
+{
+  uchar *p = d->rle;
+  uchar *end = p + d->rlesize;
+  bool wide = d->ncolors > 256;
+  bool direct = !d->ncolors;
+
+  while (p < end) {
+    uint c;
+    if (direct) {
+      memcpy(&c, p, sizeof c);
+      p += sizeof c;
+    }
+    else {
+      uint index = *p++;
+      if (wide)
+        index |= *p++ << 8;
+      c = d->palette[index];
+    }
+    size_t len = 0;
+    int shift = 0;
+    uchar b;
+    do {
+      b = *p++;
+      len |= (size_t)(b & 0x7F) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    for (len++; len; len--)
+      *pixels++ = c;
+  }
 }
 
+// fetch encoded contents back from the backing store
 static bool
-tempfile_read(tempfile_t *tempfile, unsigned char *p, size_t pos, size_t size)
+img_load(imgdata *d)
 {
-  size_t nbytes;
+  if (d->rle)
+    return true;
 
-  fflush((FILE *)tempfile->fp);
-  fseek((FILE *)tempfile->fp, pos, SEEK_SET);
-  nbytes = fread(p, 1, size, (FILE *)tempfile->fp);
-  if (nbytes != size)
+  assert(d->stored);
+  d->rle = malloc(d->rlesize);
+  if (!d->rle)
     return false;
-
+  memcpy(d->rle, store_map + d->storepos, d->rlesize);
+  store_release(d->storepos, d->rlesize);
+  d->stored = false;
+  img_memory += d->rlesize;
+  lru_touch(d);
   return true;
 }
 
-// temp_strage_t implementation
-
-static temp_strage_t *
-strage_create(void)
+// evict encoded contents to the backing store
+static void
+img_store(imgdata *d)
 {
-  temp_strage_t *strage;
-  tempfile_t *tempfile;
+  if (!d->rle || !store_alloc(d->rlesize, &d->storepos))
+    return;
 
-  tempfile = tempfile_get();
-  if (!tempfile)
-    return NULL;
+  memcpy(store_map + d->storepos, d->rle, d->rlesize);
+  free(d->rle);
+  d->rle = NULL;
+  d->stored = true;
+  img_memory -= d->rlesize;
+}
 
-  strage = malloc(sizeof(temp_strage_t));
-  if (!strage)
-    return NULL;
+// Content-addressed table of image contents,
+// so that repeatedly emitted identical images share their storage.
+
+#define IMGHASH_SIZE 1024
 
-  strage->tempfile = tempfile;
-  strage->position = tempfile_size(strage->tempfile);
+static imgdata *imghash[IMGHASH_SIZE];
 
-  return strage;
+static uint
+data_hash(imgdata *d)
+{
+  uint h = 2166136261u;  // FNV-1a
+  void hash(const unsigned char *p, size_t len) {
+    while (len--)
+      h = (h ^ *p++) * 16777619u;
+  }
+  hash((unsigned char *)&d->pixelwidth, sizeof(int));
+  hash((unsigned char *)&d->pixelheight, sizeof(int));
+  hash((unsigned char *)d->palette, d->ncolors * sizeof(uint));
+  hash(d->rle, d->rlesize);
+  return h;
+}
+
+static bool
+data_equal(imgdata *d, imgdata *other)
+{
+  return d->hash == other->hash &&
+         d->pixelwidth == other->pixelwidth &&
+         d->pixelheight == other->pixelheight &&
+         d->ncolors == other->ncolors &&
+         d->rlesize == other->rlesize &&
+         (!d->ncolors ||
+          !memcmp(d->palette, other->palette, d->ncolors * sizeof(uint))) &&
+         !memcmp(d->rle,
+                 other->rle ?: store_map + other->storepos, d->rlesize);
 }
 
+// enter new encoded contents into the table,
+// or return the shared copy of identical contents, destroying the new ones
+static imgdata *
+data_share(imgdata *d)
+{
+  d->hash = data_hash(d);
+  imgdata **bucket = &imghash[d->hash % IMGHASH_SIZE];
+  for (imgdata *other = *bucket; other; other = other->next) {
+    if (data_equal(d, other)) {
+      free(d->rle);
+      free(d->palette);
+      free(d);
+      other->refcount++;
+      return other;
+    }
+  }
+  d->refcount = 1;
+  d->next = *bucket;
+  *bucket = d;
+  img_memory += data_memsize(d);
+  lru_touch(d);
+  return d;
+}
+
+// drop the expanded pixels of an image to save the memory
 static void
-strage_destroy(temp_strage_t *strage)
+data_hibernate(imgdata *d)
 {
-  tempfile_deref(strage->tempfile);
-  free(strage);
+  if (!d->hdc)
+    return;
+
+  // delete allocated DIB section.
+  DeleteDC(d->hdc);
+  DeleteObject(d->hbmp);
+  d->pixels = NULL;
+  d->hdc = NULL;
+  d->hbmp = NULL;
+  img_memory -= data_pixelsize(d);
 }
 
-static bool
-strage_write(temp_strage_t *strage, unsigned char *p, size_t size)
+static void
+data_release(imgdata *d)
 {
-  return tempfile_write(strage->tempfile, p, strage->position, size);
+  if (--d->refcount > 0)
+    return;
+
+  imgdata **pp = &imghash[d->hash % IMGHASH_SIZE];
+  while (*pp != d)
+    pp = &(*pp)->next;
+  *pp = d->next;
+
+  lru_unlink(d);
+  data_hibernate(d);
+  img_memory -= data_memsize(d);
+  if (d->stored)
+    store_release(d->storepos, d->rlesize);
+  free(d->rle);
+  free(d->palette);
+  free(d);
 }
 
-static bool
-strage_read(temp_strage_t *strage, unsigned char *p, size_t size)
+// encode pixels into new or shared image contents
+static imgdata *
+data_new(img_row_fn getrow, void *ctx, int pixelwidth, int pixelheight)
 {
-  return tempfile_read(strage->tempfile, p, strage->position, size);
+  imgdata *d = calloc(1, sizeof(imgdata));
+  if (!d)
+    return NULL;
+
+  d->pixelwidth = pixelwidth;
+  d->pixelheight = pixelheight;
+  if (!img_encode(d, getrow, ctx)) {
+    free(d);
+    return NULL;
+  }
+  return data_share(d);
 }
 
+// create an image from pixel rows delivered by a callback
 bool
-winimg_new(imglist **ppimg, unsigned char *pixels,
+winimg_new(imglist **ppimg, img_row_fn getrow, void *ctx,
            int left, int top, int width, int height,
            int pixelwidth, int pixelheight)
 {
@@ -180,17 +557,19 @@ winimg_new(imglist **ppimg, unsigned char *pixels,
   if (!img)
     return false;
 
-  img->pixels = pixels;
-  img->hdc = NULL;
-  img->hbmp = NULL;
   img->left = left;
   img->top = top;
   img->width = width;
   img->height = height;
   img->pixelwidth = pixelwidth;
   img->pixelheight = pixelheight;
-  img->next = NULL;
-  img->strage = NULL;
+  img->seq = 0;
+
+  img->data = data_new(getrow, ctx, pixelwidth, pixelheight);
+  if (!img->data) {
+    free(img);
+    return false;
+  }
 
   *ppimg = img;
 
@@ -201,133 +580,383 @@ winimg_new(imglist **ppimg, unsigned char *pixels,
 void
 winimg_lazyinit(imglist *img)
 {
+  imgdata *d = img->data;
   BITMAPINFO bmpinfo;
   unsigned char *pixels;
   HDC dc;
-  size_t size;
 
-  if (img->hdc)
+  if (d->hdc)
     return;
 
-  size = img->pixelwidth * img->pixelheight * 4;
+  if (!img_load(d))
+    return;
 
   dc = GetDC(wnd);
 
   bmpinfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-  bmpinfo.bmiHeader.biWidth = img->pixelwidth;
-  bmpinfo.bmiHeader.biHeight = - img->pixelheight;
+  bmpinfo.bmiHeader.biWidth = d->pixelwidth;
+  bmpinfo.bmiHeader.biHeight = - d->pixelheight;
   bmpinfo.bmiHeader.biPlanes = 1;
   bmpinfo.bmiHeader.biBitCount = 32;
   bmpinfo.bmiHeader.biCompression = BI_RGB;
-  img->hdc = CreateCompatibleDC(dc);
-  img->hbmp = CreateDIBSection(dc, &bmpinfo, DIB_RGB_COLORS, (void*)&pixels, NULL, 0);
-  SelectObject(img->hdc, img->hbmp);
-  if (img->pixels) {
-    CopyMemory(pixels, img->pixels, size);
-    free(img->pixels);
-  } else {
-    // resume from hibernation
-    assert(img->strage);
-    strage_read(img->strage, pixels, size);
+  d->hdc = CreateCompatibleDC(dc);
+  d->hbmp = CreateDIBSection(dc, &bmpinfo, DIB_RGB_COLORS, (void*)&pixels, NULL, 0);
+  if (!d->hbmp) {
+    DeleteDC(d->hdc);
+    d->hdc = NULL;
+    ReleaseDC(wnd, dc);
+    return;
   }
-  img->pixels = pixels;
+  SelectObject(d->hdc, d->hbmp);
+  img_expand(d, (uint *)pixels);
+  d->pixels = pixels;
+  img_memory += data_pixelsize(d);
 
   ReleaseDC(wnd, dc);
 }
 
-// serialize an image into a temp file to save the memory
+void
+winimg_destroy(imglist *img)
+{
+  data_release(img->data);
+  free(img);
+}
+
+// replace the contents of an image with those of a new image
+// of the same size, which is destroyed
 static void
-winimg_hibernate(imglist *img)
+winimg_replace(imglist *img, imglist *src)
 {
-  size_t size;
-  temp_strage_t *strage;
+  imgdata *d = img->data;
+  img->data = src->data;
+  src->data = d;
+  winimg_destroy(src);
+}
 
-  size = img->pixelwidth * img->pixelheight * 4;
+// row access to a plain BGRA pixel buffer
+typedef struct {
+  uint *pixels;
+  int width;
+} pixelbuf;
 
-  if (!img->hdc)
-    return;
+static const uint *
+pixelbuf_row(pixelbuf *pb, int y, uint *buf)
+{
+  (void)buf;
+  return pb->pixels + (size_t)y * pb->width;
+}
 
-  strage = strage_create();
-  if (!strage)
-    return;
+// paint a new image into an image at the given pixel offset;
+// the new image is destroyed unless they cannot be merged
+static bool
+winimg_merge(imglist *img, imglist *src, int x, int y)
+{
+  imgdata *d = img->data;
+  imgdata *merged = NULL;
+  uint *pixels, *srcpixels;
+
+  if (!img_load(d) || !img_load(src->data))
+    return false;
+
+  pixels = malloc((size_t)d->pixelwidth * d->pixelheight * 4);
+  srcpixels = malloc((size_t)src->pixelwidth * src->pixelheight * 4);
+  if (pixels && srcpixels) {
+    img_expand(d, pixels);
+    img_expand(src->data, srcpixels);
+    for (int i = 0; i < src->pixelheight; ++i)
+      memcpy(pixels + (y + i) * d->pixelwidth + x,
+             srcpixels + i * src->pixelwidth,
+             src->pixelwidth * 4);
+
+    // contents may be shared, so the merged image gets new contents
+    pixelbuf pb = {pixels, d->pixelwidth};
+    merged = data_new((img_row_fn)pixelbuf_row, &pb,
+                      d->pixelwidth, d->pixelheight);
+    if (merged) {
+      img->data = merged;
+      data_release(d);
+      winimg_destroy(src);
+    }
+  }
+  free(pixels);
+  free(srcpixels);
+  return merged;
+}
+
+// Spatial index of placed images, so that painting and placing images
+// only considers those in the relevant line range: images are kept in
+// buckets by their top line, IMGINDEX_LINES virtual lines per bucket,
+// which are found through a hash table.
+
+#define IMGINDEX_LINES 64
+#define IMGINDEX_SIZE 256
+
+typedef struct imgbucket {
+  struct imgbucket *next;  // hash chain
+  int num;                 // top line / IMGINDEX_LINES
+  uint n, len;
+  imglist **imgs;          // in placement order
+} imgbucket;
+
+typedef struct imgindex {
+  imgbucket *buckets[IMGINDEX_SIZE];
+  uint count;
+  int lowest;              // lowest bucket number that may be non-empty
+  int maxheight;           // height of tallest image indexed
+} imgindex;
+
+static uint img_seq = 0;
+
+static int
+bucket_num(int line)
+{
+  return line >= 0 ? line / IMGINDEX_LINES
+                   : - ((- line - 1) / IMGINDEX_LINES) - 1;
+}
+
+static imgbucket *
+index_bucket(imgindex *ix, int num, bool create)
+{
+  imgbucket **pb = &ix->buckets[(uint)num % IMGINDEX_SIZE];
+  for (imgbucket *b = *pb; b; b = b->next)
+    if (b->num == num)
+      return b;
+  if (!create)
+    return NULL;
+
+  imgbucket *b = new(imgbucket);
+  b->num = num;
+  b->n = b->len = 0;
+  b->imgs = NULL;
+  b->next = *pb;
+  *pb = b;
+  return b;
+}
+
+static void
+index_free_bucket(imgindex *ix, imgbucket *b)
+{
+  imgbucket **pb = &ix->buckets[(uint)b->num % IMGINDEX_SIZE];
+  while (*pb != b)
+    pb = &(*pb)->next;
+  *pb = b->next;
+  free(b->imgs);
+  free(b);
+}
+
+static void
+index_add(imgindex *ix, imglist *img)
+{
+  imgbucket *b = index_bucket(ix, bucket_num(img->top), true);
+  if (b->n == b->len) {
+    b->len = b->len * 2 + 8;
+    b->imgs = renewn(b->imgs, b->len);
+  }
+  img->seq = ++img_seq;
+  b->imgs[b->n++] = img;
+
+  if (!ix->count++ || b->num < ix->lowest)
+    ix->lowest = b->num;
+  if (img->height > ix->maxheight)
+    ix->maxheight = img->height;
+}
 
-  if (!strage_write(strage, img->pixels, size)) {
-    strage_destroy(strage);
+static int
+seq_cmp(const void *a, const void *b)
+{
+  uint seq_a = (*(imglist * const *)a)->seq;
+  uint seq_b = (*(imglist * const *)b)->seq;
+  return seq_a < seq_b ? -1 : seq_a > seq_b;
+}
+
+// collect the images intersecting lines top..bottom-1, in placement order
+static uint
+index_query(imgindex *ix, int top, int bottom, imglist ***pimgs)
+{
+  uint n = 0, len = 0;
+  imglist **imgs = NULL;
+
+  if (ix && ix->count) {
+    int num = max(bucket_num(top - ix->maxheight + 1), ix->lowest);
+    for (; num <= bucket_num(bottom - 1); num++) {
+      imgbucket *b = index_bucket(ix, num, false);
+      for (uint i = 0; b && i < b->n; i++) {
+        imglist *img = b->imgs[i];
+        if (img->top < bottom && img->top + img->height > top) {
+          if (n == len) {
+            len = len * 2 + 16;
+            imgs = renewn(imgs, len);
+          }
+          imgs[n++] = img;
+        }
+      }
+    }
+    qsort(imgs, n, sizeof(imglist *), seq_cmp);
+  }
+  *pimgs = imgs;
+  return n;
+}
+
+// destroy images ending above the given line
+static void
+index_expire(imgindex *ix, int limit)
+{
+  if (!ix || !ix->count)
     return;
+
+  for (int num = ix->lowest;
+       num <= bucket_num(limit) && ix->count; num++) {
+    imgbucket *b = index_bucket(ix, num, false);
+    bool empty = true;
+    if (b) {
+      uint k = 0;
+      for (uint i = 0; i < b->n; i++) {
+        imglist *img = b->imgs[i];
+        if (img->top + img->height < limit) {
+          winimg_destroy(img);
+          ix->count--;
+        }
+        else
+          b->imgs[k++] = img;
+      }
+      b->n = k;
+      if (k)
+        empty = false;
+      else
+        index_free_bucket(ix, b);
+    }
+    if (num == ix->lowest && empty)
+      ix->lowest++;
   }
+  if (!ix->count)
+    ix->maxheight = 0;
+}
 
-  // delete allocated DIB section.
-  DeleteDC(img->hdc);
-  DeleteObject(img->hbmp);
-  img->pixels = NULL;
-  img->hdc = NULL;
-  img->hbmp = NULL;
+static void
+index_clear(imgindex *ix)
+{
+  if (!ix)
+    return;
 
-  img->strage = strage;
+  for (uint h = 0; h < IMGINDEX_SIZE; h++) {
+    while (ix->buckets[h]) {
+      imgbucket *b = ix->buckets[h];
+      for (uint i = 0; i < b->n; i++)
+        winimg_destroy(b->imgs[i]);
+      index_free_bucket(ix, b);
+    }
+  }
+  free(ix);
 }
 
+// place a new image, replacing or merging into a previous image it covers
 void
-winimg_destroy(imglist *img)
+winimgs_add(imglist *img, int grid_width, int grid_height)
 {
-  if (img->hdc) {
-    DeleteDC(img->hdc);
-    DeleteObject(img->hbmp);
-  } else if (img->pixels) {
-    free(img->pixels);
-  } else {
-    strage_destroy(img->strage);
+  imglist **imgs = NULL;
+  uint n = 0;
+
+  if (!term.imgs.index)
+    term.imgs.index = calloc(1, sizeof(imgindex));
+
+  // Only images filling their cells exactly (as sixel images do)
+  // can replace or be merged into others; other images (e.g. OSC 1337)
+  // are simply placed on top.
+  if (img->pixelwidth == img->width * grid_width &&
+      img->pixelheight == img->height * grid_height)
+    n = index_query(term.imgs.index, img->top, img->top + img->height, &imgs);
+  for (uint i = 0; i < n; i++) {
+    imglist *cur = imgs[i];
+    if (cur->pixelwidth == cur->width * grid_width &&
+        cur->pixelheight == cur->height * grid_height) {
+      if (img->top == cur->top && img->left == cur->left &&
+          img->width == cur->width &&
+          img->height == cur->height) {
+        winimg_replace(cur, img);
+        free(imgs);
+        return;
+      }
+      if (img->top >= cur->top && img->left >= cur->left &&
+          img->left + img->width <= cur->left + cur->width &&
+          img->top + img->height <= cur->top + cur->height) {
+        if (winimg_merge(cur, img,
+                         (img->left - cur->left) * grid_width,
+                         (img->top - cur->top) * grid_height)) {
+          free(imgs);
+          return;
+        }
+        break;
+      }
+    }
   }
-  free(img);
+  free(imgs);
+
+  index_add(term.imgs.index, img);
 }
 
 void
 winimgs_clear(void)
 {
-  imglist *img, *prev;
-
   // clear parser state
-  sixel_parser_deinit(term.imgs.parser_state);
-  free(term.imgs.parser_state);
+  sixel_parser_destroy(term.imgs.parser_state);
   term.imgs.parser_state = NULL;
+  imgfile_destroy(term.imgs.file_state);
+  term.imgs.file_state = NULL;
 
-  // clear images in current screen
-  for (img = term.imgs.first; img; ) {
-    prev = img;
-    img = img->next;
-    winimg_destroy(prev);
-  }
+  // clear images in current screen and in alternate screen
+  index_clear(term.imgs.index);
+  index_clear(term.imgs.altindex);
 
-  // clear images in alternate screen
-  for (img = term.imgs.altfirst; img; ) {
-    prev = img;
-    img = img->next;
-    winimg_destroy(prev);
-  }
+  term.imgs.index = NULL;
+  term.imgs.altindex = NULL;
+}
 
-  term.imgs.first = NULL;
-  term.imgs.last = NULL;
-  term.imgs.altfirst = NULL;
-  term.imgs.altlast = NULL;
+static uint paint_count = 0;
+
+// Evict least recently painted images until the memory used by images
+// is within the budget: first drop expanded pixels, then move encoded
+// contents to the backing store. Images painted last are kept.
+// Images with nothing left in memory to evict leave the LRU list.
+static void
+winimgs_trim(void)
+{
+  size_t budget = (size_t)max(cfg.image_memory, 1) * 1024 * 1024;
+  if (img_memory <= budget)
+    return;
+
+  for (imgdata *d = lru_head;
+       d && d->lru != paint_count && img_memory > budget; d = d->lru_next)
+    data_hibernate(d);
+
+  for (imgdata *d = lru_head, *next;
+       d && d->lru != paint_count && img_memory > budget; d = next) {
+    next = d->lru_next;
+    img_store(d);
+    if (!d->hdc && !d->rle)
+      lru_unlink(d);
+  }
 }
 
 void
 winimg_paint(void)
 {
   imglist *img;
-  imglist *prev = NULL;
-  int left, top;
+  imglist **imgs;
+  uint n;
+  int left, top, vtop;
   int x, y;
   termchar *dchar;
   bool update_flag;
   HDC dc;
   RECT rc;
 
-  /* free disk space if number of tempfile exceeds TEMPFILE_MAX_NUM */
-  while (tempfile_num > TEMPFILE_MAX_NUM && term.imgs.first) {
-    img = term.imgs.first;
-    term.imgs.first = term.imgs.first->next;
-    winimg_destroy(img);
-  }
+  paint_count++;
+
+  // collect images scrolled out of the scrollback
+  index_expire(term.imgs.index, term.virtuallines - term.sblines);
+
+  vtop = term.virtuallines + term.disptop;
+  n = index_query(term.imgs.index, vtop, vtop + term.rows, &imgs);
 
   dc = GetDC(wnd);
 
@@ -335,60 +964,50 @@ winimg_paint(void)
   IntersectClipRect(dc, rc.left + PADDING, rc.top + PADDING,
                     rc.left + PADDING + term.cols * cell_width,
                     rc.top + PADDING + term.rows * cell_height);
-  for (img = term.imgs.first; img;) {
-    // if the image is out of scrollback, collect it
-    if (img->top + img->height - term.virtuallines < - term.sblines) {
-      if (img == term.imgs.first)
-        term.imgs.first = img->next;
-      if (img == term.imgs.last)
-        term.imgs.last = prev;
-      if (prev)
-        prev->next = img->next;
-      prev = img;
-      img = img->next;
-      winimg_destroy(prev);
-    } else {
-      // if the image is scrolled out, serialize it into a temp file.
-      left = img->left;
-      top = img->top - term.virtuallines - term.disptop;
-      if (top + img->height < 0 || top > term.rows) {
-        winimg_hibernate(img);
-      } else {
-        // create DC handle if it is not initialized, or resume from hibernate
-        winimg_lazyinit(img);
-        for (y = max(0, top); y < min(top + img->height, term.rows); ++y) {
-          int wide_factor = (term.displines[y]->lattr & LATTR_MODE) == LATTR_NORM ? 1: 2;
-          for (x = left; x < min(left + img->width, term.cols); ++x) {
-            dchar = &term.displines[y]->chars[x];
-
-            // if sixel image is overwirtten by characters,
-            // exclude the area from the clipping rect.
-            update_flag = false;
-            if (dchar->chr != SIXELCH)
-              update_flag = true;
-            if (dchar->attr.attr & (TATTR_RESULT | TATTR_CURRESULT | TATTR_MARKED | TATTR_CURMARKED))
-              update_flag = true;
-            if (term.selected && !update_flag) {
-              pos scrpos = {y + term.disptop, x};
-              update_flag = term.sel_rect
-                  ? posPle(term.sel_start, scrpos) && posPlt(scrpos, term.sel_end)
-                  : posle(term.sel_start, scrpos) && poslt(scrpos, term.sel_end);
-            }
-            if (update_flag)
-              ExcludeClipRect(dc,
-                              x * wide_factor * cell_width + PADDING,
-                              y * cell_height + PADDING,
-                              (x + 1) * wide_factor * cell_width + PADDING,
-                              (y + 1) * cell_height + PADDING);
-          }
+  for (uint i = 0; i < n; i++) {
+    img = imgs[i];
+    left = img->left;
+    top = img->top - vtop;
+
+    // create DC handle if it is not initialized, or resume from hibernate
+    winimg_lazyinit(img);
+    if (!img->data->hdc)
+      continue;
+    img->data->lru = paint_count;
+    lru_touch(img->data);
+    for (y = max(0, top); y < min(top + img->height, term.rows); ++y) {
+      int wide_factor = (term.displines[y]->lattr & LATTR_MODE) == LATTR_NORM ? 1: 2;
+      for (x = left; x < min(left + img->width, term.cols); ++x) {
+        dchar = &term.displines[y]->chars[x];
+
+        // if sixel image is overwirtten by characters,
+        // exclude the area from the clipping rect.
+        update_flag = false;
+        if (dchar->chr != SIXELCH)
+          update_flag = true;
+        if (dchar->attr.attr & (TATTR_RESULT | TATTR_CURRESULT | TATTR_MARKED | TATTR_CURMARKED))
+          update_flag = true;
+        if (term.selected && !update_flag) {
+          pos scrpos = {y + term.disptop, x};
+          update_flag = term.sel_rect
+              ? posPle(term.sel_start, scrpos) && posPlt(scrpos, term.sel_end)
+              : posle(term.sel_start, scrpos) && poslt(scrpos, term.sel_end);
         }
-        StretchBlt(dc, left * cell_width + PADDING, top * cell_height + PADDING,
-                   img->width * cell_width, img->height * cell_height, img->hdc,
-                   0, 0, img->pixelwidth, img->pixelheight, SRCCOPY);
+        if (update_flag)
+          ExcludeClipRect(dc,
+                          x * wide_factor * cell_width + PADDING,
+                          y * cell_height + PADDING,
+                          (x + 1) * wide_factor * cell_width + PADDING,
+                          (y + 1) * cell_height + PADDING);
       }
-      prev = img;
-      img = img->next;
     }
+    StretchBlt(dc, left * cell_width + PADDING, top * cell_height + PADDING,
+               img->width * cell_width, img->height * cell_height, img->data->hdc,
+               0, 0, img->pixelwidth, img->pixelheight, SRCCOPY);
   }
   ReleaseDC(wnd, dc);
+  free(imgs);
+
+  // keep images not displayed within the memory budget
+  winimgs_trim();
 }
@@ -3,12 +3,16 @@
 
 #include "config.h"
 
+// deliver row y of an image as BGRA pixels, either in buf or elsewhere
+typedef const uint * (* img_row_fn)(void * ctx, int y, uint * buf);
+
 bool
-winimg_new(imglist **ppimg, unsigned char *pixels,
-           int top, int left, int width, int height,
+winimg_new(imglist **ppimg, img_row_fn getrow, void *ctx,
+           int left, int top, int width, int height,
            int pixelwidth, int pixelheight);
 void winimg_destroy(imglist *img);
 void winimg_lazyinit(imglist *img);
+void winimgs_add(imglist *img, int grid_width, int grid_height);
 void winimg_paint(void);
 void winimgs_clear(void);
 
@@ -7,6 +7,8 @@
 
 #include "charset.h"
 #include "child.h"
+#include "record.h"
+#include "latency.h"
 
 #include <math.h>
 #include <windowsx.h>
@@ -273,6 +275,9 @@ win_init_ctxmenu(bool extended_menu)
   if (extended_menu) {
     //__ Context menu:
     AppendMenuW(ctxmenu, MF_ENABLED, IDM_CLRSCRLBCK, _W("Clear Scrollback"));
+    //__ Context menu:
+    AppendMenuW(ctxmenu, *cfg.session_file ? MF_ENABLED : MF_GRAYED,
+                IDM_SAVESESSION, _W("Save Session"));
   }
   AppendMenuW(ctxmenu, MF_SEPARATOR, 0, 0);
   AppendMenuW(ctxmenu, MF_ENABLED | MF_UNCHECKED, IDM_DEFSIZE_ZOOM, 0);
@@ -639,6 +644,7 @@ win_key_down(WPARAM wp, LPARAM lp)
 {
   uint key = wp;
   last_key = key;
+  latency_mark(LAT_KEY);
 
   if (comp_state == COMP_ACTIVE)
     comp_state = COMP_PENDING;
@@ -702,6 +708,10 @@ win_key_down(WPARAM wp, LPARAM lp)
   if (alt_state > ALT_NONE)
     alt_state = ALT_CANCELLED;
 
+  // Playback control when replaying a session recording
+  if (!mods && replay_key(key))
+    return true;
+
   // Context and window menus
   if (key == VK_APPS && !*cfg.key_menu) {
     if (shift)
@@ -19,11 +19,13 @@ char * mintty_debug;
 #include "term.h"
 #include "appinfo.h"
 #include "child.h"
+#include "record.h"
 #include "charset.h"
 
 #include <locale.h>
 #include <getopt.h>
 #include <pwd.h>
+#include <time.h>
 
 #include <mmsystem.h>  // PlaySound for MSys
 #include <shellapi.h>
@@ -270,9 +272,99 @@ set_per_monitor_dpi_aware(void)
   return false;
 }
 
+/*
+ * Timers are run by the event loop in child_proc, which waits no longer
+ * than until the next one is due. There are only a few timer callbacks,
+ * so they are kept in a small table; setting a timer again replaces its
+ * due time. While Windows runs a modal loop (moving, sizing, menus),
+ * child_proc is not called, so a Windows timer stands in for the loop.
+ */
+static struct {
+  void_fn cb;
+  int due;
+} timers[32];
+static uint timers_len;
+static bool in_modal_loop;
+
+static void modal_timer(void);
+
+static void
+set_modal_timer(void)
+{
+  int wait = win_timer_wait();
+  if (wait >= 0)
+    SetTimer(wnd, (UINT_PTR)modal_timer, wait, null);
+}
+
+static void
+modal_timer(void)
+{
+  win_run_timers();
+  if (in_modal_loop)
+    set_modal_timer();
+}
+
+static void
+set_modal_loop(bool modal)
+{
+  in_modal_loop = modal;
+  if (modal)
+    set_modal_timer();
+  else
+    KillTimer(wnd, (UINT_PTR)modal_timer);
+}
+
 void
 win_set_timer(void (*cb)(void), uint ticks)
-{ SetTimer(wnd, (UINT_PTR)cb, ticks, null); }
+{
+  int due = get_tick_count() + ticks;
+  uint i = 0;
+  while (i < timers_len && timers[i].cb != cb)
+    i++;
+  if (i == lengthof(timers)) {
+    // table full, fall back to a Windows timer
+    SetTimer(wnd, (UINT_PTR)cb, ticks, null);
+    return;
+  }
+  timers[i].cb = cb;
+  timers[i].due = due;
+  if (i == timers_len)
+    timers_len++;
+  if (in_modal_loop)
+    set_modal_timer();
+}
+
+/*
+ * Milliseconds until the next timer is due, or -1 if there is none.
+ */
+int
+win_timer_wait(void)
+{
+  if (!timers_len)
+    return -1;
+  int now = get_tick_count();
+  int wait = INT_MAX;
+  for (uint i = 0; i < timers_len; i++)
+    wait = min(wait, timers[i].due - now);
+  return max(0, wait);
+}
+
+void
+win_run_timers(void)
+{
+  int now = get_tick_count();
+  for (uint i = 0; i < timers_len;) {
+    if (timers[i].due - now <= 0) {
+      // remove the timer before its callback may set it again
+      void_fn cb = timers[i].cb;
+      timers[i] = timers[--timers_len];
+      cb();
+      i = 0;
+    }
+    else
+      i++;
+  }
+}
 
 void
 win_set_title(char *title)
@@ -888,7 +980,15 @@ win_set_chars(int rows, int cols)
 
 
 // Clockwork
-int get_tick_count(void) { return GetTickCount(); }
+// GetTickCount only advances every 10-16ms, too coarse for frame timing.
+int
+get_tick_count(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 int cursor_blink_ticks(void) { return GetCaretBlinkTime(); }
 
 static void
@@ -1432,6 +1532,12 @@ static struct {
         return 1;
       }
 
+    when WM_ENTERMENULOOP:
+      set_modal_loop(true);
+
+    when WM_EXITMENULOOP:
+      set_modal_loop(false);
+
     when WM_TIMER: {
       KillTimer(wnd, wp);
       void_fn cb = (void_fn)wp;
@@ -1468,6 +1574,7 @@ static struct {
         when IDM_COPY: term_copy();
         when IDM_COPASTE: term_copy(); win_paste();
         when IDM_CLRSCRLBCK: term_clear_scrollback(); term.disptop = 0;
+        when IDM_SAVESESSION: term_save_session();
         when IDM_TOGLOG: toggle_logging();
         when IDM_TOGCHARINFO: toggle_charinfo();
         when IDM_PASTE: win_paste();
@@ -1665,6 +1772,7 @@ static struct {
     when WM_ENTERSIZEMOVE:
       trace_resize(("# WM_ENTERSIZEMOVE VK_SHIFT %02X\n", (uchar)GetKeyState(VK_SHIFT)));
       resizing = true;
+      set_modal_loop(true);
 
     when WM_SIZING: {  // mouse-drag window resizing
       trace_resize(("# WM_SIZING (resizing %d) VK_SHIFT %02X\n", resizing, (uchar)GetKeyState(VK_SHIFT)));
@@ -1741,6 +1849,8 @@ static struct {
     when WM_EXITSIZEMOVE or WM_CAPTURECHANGED: { // after mouse-drag resizing
       trace_resize(("# WM_EXITSIZEMOVE (resizing %d) VK_SHIFT %02X\n", resizing, (uchar)GetKeyState(VK_SHIFT)));
       bool shift = GetKeyState(VK_SHIFT) & 0x80;
+      if (message == WM_EXITSIZEMOVE)
+        set_modal_loop(false);
 
       if (resizing) {
         resizing = false;
@@ -1986,6 +2096,7 @@ void
 exit_mintty(void)
 {
   report_pos();
+  term_save_session();
   exit(0);
 }
 
@@ -2277,6 +2388,7 @@ opts[] = {
   {"icon",       required_argument, 0, 'i'},
   {"log",        required_argument, 0, 'l'},
   {"logfile",    required_argument, 0, ''},
+  {"replay",     required_argument, 0, ''},  // short option not enabled
   {"utmp",       no_argument,       0, 'u'},
   {"option",     required_argument, 0, 'o'},
   {"position",   required_argument, 0, 'p'},
@@ -2408,6 +2520,9 @@ main(int argc, char *argv[])
       when 'i': set_arg_option("Icon", optarg);
       when 'l': set_arg_option("Log", optarg);
       when '': set_arg_option("Log", optarg); set_arg_option("Logging", "0");
+      when '':
+        if (!replay_open(optarg))
+          option_error(__("Could not replay session recording '%s'"), optarg);
       when 'o': parse_arg_option(optarg);
       when 'p':
         if (strcmp(optarg, "center") == 0 || strcmp(optarg, "centre") == 0)
@@ -2895,6 +3010,7 @@ main(int argc, char *argv[])
   // Initialise the terminal.
   term_reset();
   term_resize(term_rows, term_cols);
+  term_restore_session();
 
   // Initialise the scroll bar.
   SetScrollInfo(
@@ -2929,10 +3045,13 @@ main(int argc, char *argv[])
 #endif
   }
 
-  // Create child process.
-  child_create(
-    argv, &(struct winsize){term_rows, term_cols, term_width, term_height}
-  );
+  // Create child process, or replay a session recording instead.
+  if (replaying)
+    replay_start();
+  else
+    child_create(
+      argv, &(struct winsize){term_rows, term_cols, term_width, term_height}
+    );
 
   // Finally show the window!
   go_fullscr_on_max = (cfg.window == -1);
@@ -8,6 +8,7 @@
 #include "charset.h"  // wcscpy, combiningdouble
 #include "config.h"
 #include "winimg.h"  // winimg_paint
+#include "latency.h"
 
 #include <winnls.h>
 #include <usp10.h>  // Uniscribe
@@ -724,6 +725,20 @@ static HDC dc;
 static enum { UPDATE_IDLE, UPDATE_BLOCKED, UPDATE_PENDING } update_state;
 static bool ime_open;
 
+/*
+ * Frame scheduling: after output, the screen is painted with a short delay
+ * that lets the rest of a write arrive, but frames are spaced by at least
+ * 1/FrameRate seconds, or twice the time the last frame took to paint,
+ * so that floods of output cost only that many frames.
+ * A frame that draws nothing, as only invisible state changed, neither
+ * counts towards that rate nor holds back the next one.
+ */
+#define UPDATE_DELAY 1
+
+static int last_frame_tick;
+static int frame_gap;
+static uint text_runs;  // drawn by win_text
+
 void
 win_paint(void)
 {
@@ -975,7 +990,15 @@ do_update(void)
     return;
   }
 
+  // Nothing to see while minimized; restoring repaints the window.
+  if (win_is_iconic()) {
+    update_state = UPDATE_IDLE;
+    return;
+  }
+
   update_state = UPDATE_BLOCKED;
+  int start = get_tick_count();
+  uint runs = text_runs;
 
   dc = GetDC(wnd);
 
@@ -1015,8 +1038,18 @@ do_update(void)
     }
   }
 
+  // Skip the frame if nothing was drawn.
+  bool drawn = text_runs != runs;
+  latency_frame(drawn);
+  if (!drawn) {
+    update_state = UPDATE_IDLE;
+    return;
+  }
+
   // Schedule next update.
-  win_set_timer(do_update, 16);
+  last_frame_tick = get_tick_count();
+  frame_gap = max(1000 / max(1, cfg.frame_rate), 2 * (last_frame_tick - start));
+  win_set_timer(do_update, frame_gap);
 }
 
 void
@@ -1032,8 +1065,10 @@ win_update(void)
 void
 win_schedule_update(void)
 {
-  if (update_state == UPDATE_IDLE)
-    win_set_timer(do_update, 16);
+  if (update_state == UPDATE_IDLE) {
+    int since = get_tick_count() - last_frame_tick;
+    win_set_timer(do_update, max(UPDATE_DELAY, frame_gap - since));
+  }
   update_state = UPDATE_PENDING;
 }
 
@@ -1219,6 +1254,8 @@ win_text(int x, int y, wchar *text, int len, cattr attr, cattr *textattr, ushort
   int findex = (attr.attr & FONTFAM_MASK) >> ATTR_FONTFAM_SHIFT;
   struct fontfam * ff = &fontfamilies[findex];
 
+  text_runs++;
+
   bool clearpad = lattr & LATTR_CLEARPAD;
   trace_line("win_text:", text, len);
 